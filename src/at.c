@@ -0,0 +1,301 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Asynchronous AT command channel.
+ *
+ * Commands submitted to a channel are queued and sent one at a time
+ * from the uloop event loop. Their callback is called once the final
+ * result code is received, so the process is never blocked waiting for
+ * the modem. While no command is in progress, input on the channel is
+ * handled like udiald_tty_drain does: URCs are dispatched to their
+ * handlers, anything else is discarded.
+ *
+ * The blocking udiald_tty_get and friends share the input buffer with
+ * the channel, so they must not be used on the same fd while the
+ * channel has a command in progress.
+ */
+
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "udiald.h"
+
+// Time to wait for the rest of the reply to an aborted command, in ms
+#define UDIALD_AT_DISCARD_TIMEOUT 2500
+
+static void udiald_at_next(struct udiald_at_channel *ch);
+
+/**
+ * Finish the current command and call its callback. errno should be
+ * set when res is UDIALD_FAIL.
+ */
+static void udiald_at_finish(struct udiald_at_channel *ch, enum udiald_atres res) {
+	struct udiald_at_cmd *c = ch->cur;
+	int err = errno;
+
+	uloop_timeout_cancel(&ch->timeout);
+	ch->cur = NULL;
+	ch->cancelled = false;
+
+	if (c) {
+		// Commands submitted by the callback are only started once
+		// it returns (by our caller), since starting one resets the
+		// reply it is reading
+		ch->in_callback = true;
+		errno = err;
+		c->cb(c, res, &ch->r);
+		ch->in_callback = false;
+	}
+}
+
+/**
+ * Update the events we are interested in: always readable, writable
+ * only while a command is only partially written.
+ */
+static void udiald_at_update_events(struct udiald_at_channel *ch) {
+	unsigned int events = ULOOP_READ;
+	if (ch->cur && ch->written < strlen(ch->cur->cmd))
+		events |= ULOOP_WRITE;
+	uloop_fd_add(&ch->fd, events);
+}
+
+/**
+ * Write as much of the current command as the tty accepts.
+ *
+ * Returns 0 on success (even when not everything was written), or -1
+ * on error.
+ */
+static int udiald_at_write(struct udiald_at_channel *ch) {
+	struct udiald_at_cmd *c = ch->cur;
+	size_t len = strlen(c->cmd);
+
+	while (ch->written < len) {
+		ssize_t n = udiald_tty_put_partial(ch->fd.fd, c->cmd, ch->written);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			syslog(LOG_ERR, "Write failed: %s", strerror(errno));
+			return -1;
+		}
+		ch->written += n;
+	}
+	udiald_at_update_events(ch);
+	return 0;
+}
+
+/**
+ * Fail the current command and everything that is queued, for when the
+ * tty is no longer usable.
+ */
+static void udiald_at_fail_all(struct udiald_at_channel *ch, int err) {
+	ch->dead = true;
+	uloop_fd_delete(&ch->fd);
+	uloop_timeout_cancel(&ch->timeout);
+	while (ch->cur || !list_empty(&ch->queue)) {
+		if (!ch->cur) {
+			ch->cur = list_first_entry(&ch->queue, struct udiald_at_cmd, h);
+			list_del(&ch->cur->h);
+		}
+		errno = err;
+		udiald_at_finish(ch, UDIALD_FAIL);
+	}
+}
+
+/**
+ * Start sending the next queued command, if the channel is idle.
+ */
+static void udiald_at_next(struct udiald_at_channel *ch) {
+	if (ch->cur || ch->cancelled || ch->dead || ch->in_callback || list_empty(&ch->queue))
+		return;
+
+	// Get rid of any leftovers and pending URCs first
+	udiald_tty_drain(ch->fd.fd);
+
+	ch->cur = list_first_entry(&ch->queue, struct udiald_at_cmd, h);
+	list_del(&ch->cur->h);
+	ch->written = 0;
+
+	if (udiald_tty_reply_start(ch->fd.fd, &ch->r) || udiald_at_write(ch)) {
+		udiald_at_fail_all(ch, EIO);
+		return;
+	}
+	uloop_timeout_set(&ch->timeout, ch->cur->timeout);
+}
+
+/**
+ * Abort the command that is in progress, by writing a carriage return,
+ * and discard the rest of its reply when it arrives (or after
+ * UDIALD_AT_DISCARD_TIMEOUT), before the next command is sent.
+ */
+static void udiald_at_abort(struct udiald_at_channel *ch) {
+	// Any character aborts commands that are abortable (e.g. ATD)
+	if (write(ch->fd.fd, "\r", 1) != 1)
+		syslog(LOG_WARNING, "Failed to abort command: %s", strerror(errno));
+	else
+		udiald_trace_record(ch->fd.fd, UDIALD_TRACE_TX, "\r", 1);
+
+	ch->cur = NULL;
+	ch->cancelled = true;
+	udiald_at_update_events(ch);
+	uloop_timeout_set(&ch->timeout, UDIALD_AT_DISCARD_TIMEOUT);
+}
+
+static void udiald_at_timeout_cb(struct uloop_timeout *t) {
+	struct udiald_at_channel *ch = container_of(t, struct udiald_at_channel, timeout);
+	struct udiald_at_cmd *c = ch->cur;
+
+	if (!c) {
+		// The rest of an aborted reply never came, go on anyway
+		syslog(LOG_WARNING, "No final result for an aborted command, continuing");
+		ch->cancelled = false;
+		udiald_at_next(ch);
+		return;
+	}
+
+	// A late reply must not be taken for the reply to the next
+	// command, so treat this like a cancel
+	syslog(LOG_ERR, "No complete response received within %d ms", c->timeout);
+	udiald_at_abort(ch);
+	ch->in_callback = true;
+	errno = ETIMEDOUT;
+	c->cb(c, UDIALD_FAIL, &ch->r);
+	ch->in_callback = false;
+}
+
+static void udiald_at_fd_cb(struct uloop_fd *u, unsigned int events) {
+	struct udiald_at_channel *ch = container_of(u, struct udiald_at_channel, fd);
+
+	if (u->error || u->eof) {
+		syslog(LOG_ERR, "Lost connection to the modem");
+		udiald_at_fail_all(ch, EIO);
+		return;
+	}
+
+	if ((events & ULOOP_WRITE) && ch->cur && udiald_at_write(ch)) {
+		udiald_at_fail_all(ch, EIO);
+		return;
+	}
+
+	if (!(events & ULOOP_READ))
+		return;
+
+	if (!ch->cur && !ch->cancelled) {
+		udiald_tty_drain(u->fd);
+		return;
+	}
+
+	// The command that was cancelled might be freed already, so
+	// don't look at its result prefix
+	const char *prefix = ch->cur ? ch->cur->result_prefix : NULL;
+	enum udiald_atres res = udiald_tty_reply_feed(u->fd, &ch->r, prefix);
+	if (res == UDIALD_FAIL && errno == EAGAIN)
+		return;
+
+	if (res == UDIALD_FAIL) {
+		udiald_at_fail_all(ch, errno);
+		return;
+	}
+
+	udiald_at_finish(ch, res);
+	udiald_at_next(ch);
+}
+
+/**
+ * Set up an AT channel on the given (non-blocking) tty fd and register
+ * it with uloop.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int udiald_at_channel_init(struct udiald_at_channel *ch, int fd) {
+	memset(ch, 0, sizeof(*ch));
+	INIT_LIST_HEAD(&ch->queue);
+	ch->fd.fd = fd;
+	ch->fd.cb = udiald_at_fd_cb;
+	ch->timeout.cb = udiald_at_timeout_cb;
+	return uloop_fd_add(&ch->fd, ULOOP_READ);
+}
+
+/**
+ * Cancel all commands and unregister the channel from uloop. The fd
+ * itself is not closed.
+ */
+void udiald_at_channel_close(struct udiald_at_channel *ch) {
+	struct udiald_at_cmd *c, *tmp;
+	// Callbacks must not be able to submit new commands
+	ch->dead = true;
+	list_for_each_entry_safe(c, tmp, &ch->queue, h)
+		udiald_at_cancel(ch, c);
+	if (ch->cur)
+		udiald_at_cancel(ch, ch->cur);
+	uloop_timeout_cancel(&ch->timeout);
+	uloop_fd_delete(&ch->fd);
+}
+
+/**
+ * Queue a command for sending. The callback in c is always called,
+ * even when sending fails right away. c must not be modified or freed
+ * until then.
+ *
+ * Callbacks may submit commands too, these are sent once the callback
+ * returns.
+ */
+void udiald_at_submit(struct udiald_at_channel *ch, struct udiald_at_cmd *c) {
+	if (ch->dead) {
+		errno = EIO;
+		c->cb(c, UDIALD_FAIL, NULL);
+		return;
+	}
+
+	if (c->urgent) {
+		// Go before the first non-urgent command
+		struct udiald_at_cmd *q;
+		list_for_each_entry(q, &ch->queue, h) {
+			if (!q->urgent)
+				break;
+		}
+		list_add_tail(&c->h, &q->h);
+	} else {
+		list_add_tail(&c->h, &ch->queue);
+	}
+	udiald_at_next(ch);
+}
+
+/**
+ * Cancel a submitted command. Its callback is called right away, with
+ * UDIALD_FAIL and errno set to ECANCELED. c can be freed after this
+ * returns.
+ *
+ * When the command was already (partially) sent, a carriage return is
+ * written to terminate or abort it. The rest of its reply is discarded
+ * when it arrives, before the next command is sent.
+ */
+void udiald_at_cancel(struct udiald_at_channel *ch, struct udiald_at_cmd *c) {
+	if (c != ch->cur) {
+		// Not sent yet, simply remove it from the queue
+		list_del(&c->h);
+		errno = ECANCELED;
+		c->cb(c, UDIALD_FAIL, NULL);
+		return;
+	}
+
+	udiald_at_abort(ch);
+	errno = ECANCELED;
+	c->cb(c, UDIALD_FAIL, NULL);
+}
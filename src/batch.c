@@ -0,0 +1,169 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include "udiald.h"
+
+// Longest command line udiald_tty_batch will ever build
+#define UDIALD_BATCH_MAXLEN 512
+// Command line length to use when the profile does not specify one.
+// V.250 requires modems to accept at least 40 characters.
+#define UDIALD_BATCH_DEFAULTLEN 40
+
+/**
+ * Store the given reply line in the query.
+ */
+static void udiald_batch_store(struct udiald_tty_query *q, const char *line) {
+	snprintf(q->reply, sizeof(q->reply), "%s", line);
+}
+
+/**
+ * Send queries first up to (but not including) last as a single
+ * command line and distribute the reply lines over them.
+ *
+ * Returns the final result code of the command line.
+ */
+static enum udiald_atres udiald_batch_line(int fd, struct udiald_tty_query *first, struct udiald_tty_query *last, int timeout) {
+	char cmd[UDIALD_BATCH_MAXLEN + 2];
+	size_t len = snprintf(cmd, sizeof(cmd), "AT");
+	struct udiald_tty_query *q;
+
+	for (q = first; q != last; ++q) {
+		len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s", q == first ? "" : ";", q->cmd);
+		q->res = UDIALD_FAIL;
+		q->reply[0] = '\0';
+	}
+	snprintf(cmd + len, sizeof(cmd) - len, "\r");
+
+	struct udiald_tty_read r = {0};
+	enum udiald_atres res = UDIALD_FAIL;
+	if (udiald_tty_put(fd, cmd) >= 0)
+		res = udiald_tty_get(fd, &r, NULL, timeout);
+
+	// Leave the final result code out
+	for (size_t i = 0; i + 1 < r.lines; ++i) {
+		const char *line = r.line[i].s;
+
+		// Skip the echo of the command line, if echo is on
+		if (!strncmp(line, cmd, len) && line[len] == '\0')
+			continue;
+
+		// Find the query this reply belongs to. Lines that have
+		// a known prefix go to that query, others go to the first
+		// query without a prefix that has no reply yet.
+		struct udiald_tty_query *match = NULL;
+		for (q = first; q != last && !match; ++q) {
+			if (q->prefix && !q->reply[0] && !strncmp(line, q->prefix, strlen(q->prefix)))
+				match = q;
+		}
+		for (q = first; q != last && !match; ++q) {
+			if (!q->prefix && !q->reply[0])
+				match = q;
+		}
+
+		if (match)
+			udiald_batch_store(match, line);
+		else
+			syslog(LOG_DEBUG, "Ignoring unexpected reply line: %s", line);
+	}
+
+	if (res == UDIALD_AT_OK) {
+		for (q = first; q != last; ++q)
+			q->res = res;
+	} else if (last - first == 1) {
+		first->res = res;
+		// Keep the error line (if any) for error reporting
+		if (!first->reply[0] && r.lines)
+			udiald_batch_store(first, r.line[r.lines - 1].s);
+	}
+	return res;
+}
+
+/**
+ * Does the result code say the command line was rejected (rather than
+ * not answered)? Only then is it worth splitting it up.
+ */
+static bool udiald_batch_error(enum udiald_atres res) {
+	return res == UDIALD_AT_ERROR || res == UDIALD_AT_CMEERROR || res == UDIALD_AT_NOT_SUPPORTED;
+}
+
+/**
+ * Execute the given queries, using as few command lines as possible.
+ *
+ * Queries are packed into command lines of at most maxlen characters
+ * (including the "AT" prefix and terminating \r), separated by
+ * semicolons. When maxlen is 0, a conservative default is used.
+ *
+ * Each reply line is routed back to the query with a matching prefix.
+ * Queries without a prefix get the remaining lines in order, so each
+ * of those must produce exactly one reply line.
+ *
+ * When a combined command line is rejected with an error, its queries
+ * are retried one by one, so each query gets its own result code. When
+ * the modem does not answer at all, this returns right away and the
+ * remaining queries fail with UDIALD_FAIL.
+ *
+ * After this function returns, res and reply in each query are
+ * filled. Only the first reply line of each query is kept.
+ *
+ * Returns the number of queries that did not return OK.
+ */
+int udiald_tty_batch(int fd, struct udiald_tty_query *q, size_t n, size_t maxlen, int timeout) {
+	size_t failed = 0;
+	size_t i = 0;
+
+	if (!maxlen)
+		maxlen = UDIALD_BATCH_DEFAULTLEN;
+	else if (maxlen > UDIALD_BATCH_MAXLEN)
+		maxlen = UDIALD_BATCH_MAXLEN;
+
+	while (i < n) {
+		// "AT" and "\r" for the first query, ";" for the others
+		size_t len = 3 + strlen(q[i].cmd);
+		size_t j = i + 1;
+		while (j < n && len + 1 + strlen(q[j].cmd) <= maxlen)
+			len += 1 + strlen(q[j++].cmd);
+
+		enum udiald_atres res = udiald_batch_line(fd, &q[i], &q[j], timeout);
+		if (udiald_batch_error(res) && j - i > 1) {
+			syslog(LOG_INFO, "Combined command failed, retrying %zu commands separately", j - i);
+			for (size_t k = i; k < j && res != UDIALD_FAIL; ++k)
+				res = udiald_batch_line(fd, &q[k], &q[k + 1], timeout);
+		}
+
+		for (size_t k = i; k < j; ++k) {
+			if (q[k].res != UDIALD_AT_OK)
+				failed++;
+		}
+		i = j;
+
+		// The modem did not answer (e.g. a timeout), don't wait for
+		// each of the remaining queries as well
+		if (res == UDIALD_FAIL) {
+			for (; i < n; ++i) {
+				q[i].res = UDIALD_FAIL;
+				q[i].reply[0] = '\0';
+				failed++;
+			}
+		}
+	}
+	return failed;
+}
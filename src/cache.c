@@ -0,0 +1,94 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Cache of modem settings applied by earlier runs, so reconnects can
+ * skip setup commands that would not change anything.
+ *
+ * Entries live in the uci state (udiald_cache_<what> options), so they
+ * survive between runs but not reboots. Each entry is tagged with the
+ * device id, USB ids and modem identification, so it is ignored for
+ * any other modem. Callers are expected to check with the modem that a
+ * cached setting is still in place before skipping anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "udiald.h"
+#include "config.h"
+
+/**
+ * Build the uci option name for the given entry.
+ */
+static void udiald_cache_option(const char *what, char *buf, size_t len) {
+	snprintf(buf, len, "udiald_cache_%s", what);
+}
+
+/**
+ * Build the tag identifying the current modem. The identification is
+ * the modem name from the var store, as set by udiald_identify. The
+ * dialer does not identify the modem itself, so it uses the modem_name
+ * the connecting udiald committed to the state before starting pppd.
+ */
+static void udiald_cache_key(struct udiald_state *state, char *buf, size_t len) {
+	const char *name = udiald_var_get(state, UDIALD_VAR_MODEM_NAME);
+	char *stored = name ? NULL : udiald_config_get(state, "modem_name");
+	if (stored)
+		name = stored;
+	snprintf(buf, len, "%s %04x:%04x %s", state->modem.device_id,
+		state->modem.vendor, state->modem.device, name ? name : "");
+	free(stored);
+}
+
+/**
+ * Return the value cached for the given setting, or NULL when there is
+ * none or it was stored for a different modem. The caller should free
+ * the result.
+ */
+char *udiald_cache_get(struct udiald_state *state, const char *what) {
+	char opt[64], key[128];
+	udiald_cache_option(what, opt, sizeof(opt));
+	udiald_cache_key(state, key, sizeof(key));
+
+	char *entry = udiald_config_get(state, opt);
+	size_t keylen = strlen(key);
+	if (!entry || strncmp(entry, key, keylen) || entry[keylen] != '\t') {
+		free(entry);
+		return NULL;
+	}
+	memmove(entry, entry + keylen + 1, strlen(entry + keylen + 1) + 1);
+	return entry;
+}
+
+/**
+ * Store a setting in the cache, or remove it when value is NULL. This
+ * does not save the state.
+ */
+void udiald_cache_set(struct udiald_state *state, const char *what, const char *value) {
+	char opt[64], key[128], entry[512];
+	udiald_cache_option(what, opt, sizeof(opt));
+	udiald_config_revert(state, opt);
+	if (!value)
+		return;
+
+	udiald_cache_key(state, key, sizeof(key));
+	snprintf(entry, sizeof(entry), "%s\t%s", key, value);
+	udiald_config_set(state, opt, entry);
+}
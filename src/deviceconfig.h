@@ -141,6 +141,23 @@ static const struct udiald_profile profiles[] = {
 			.dialcmd = "ATD*99***1#\r",
 		},
 	},
+	// Never matches automatically, since the generic profile above
+	// comes first. Select it for sticks with an NCM interface (e.g.
+	// E3276, E3372 in stick mode), which are much faster than PPP
+	// over a tty.
+	{
+		.name   = "12D1NCM",
+		.desc   = "Huawei generic (NCM)",
+		.vendor = 0x12d1,
+		.flags  = UDIALD_PROFILE_NODEVICE,
+		.cfg = {
+			.ctlidx = 1,
+			.datidx = 0,
+			.modecmd = HUAWEI_SYSCFG_MODECMD,
+			.dialcmd = "ATD*99***1#\r",
+			.datapath = UDIALD_DATAPATH_NCM,
+		},
+	},
 	{
 		.name   = "19D2",
 		.desc   = "ZTE generic",
@@ -180,6 +197,7 @@ static const struct udiald_profile profiles[] = {
 				[UDIALD_MODE_AUTO] = "",
 			},
 			.dialcmd = "ATD*99***1#\r",
+			.signal = UDIALD_SIGNAL_CESQ | UDIALD_SIGNAL_GSTATUS,
 		},
 	},
 	{
@@ -22,6 +22,7 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -29,6 +30,13 @@
 #include "udiald.h"
 #include "config.h"
 
+// Number of times to dial before giving up
+#define UDIALD_DIAL_ATTEMPTS 9
+// How long to wait for network registration before the first and
+// before later dial attempts, in ms
+#define UDIALD_DIAL_NETWORK_TIMEOUT 45000
+#define UDIALD_DIAL_RETRY_TIMEOUT 5000
+
 static void fatal_error(struct udiald_state *state, const char *fmt, ...) {
 	char buf[256];
 	va_list ap;
@@ -38,37 +46,85 @@ static void fatal_error(struct udiald_state *state, const char *fmt, ...) {
 	va_end(ap);
 
 	syslog(LOG_ERR, "%s", buf);
+	udiald_trace_dump(NULL);
 	udiald_config_set(state, "udiald_dial_error_msg", buf);
-	ucix_save(state->uci, state->uciname);
+	udiald_var_commit(state);
 }
 
-int udiald_dial_main(struct udiald_state *state) {
+/**
+ * Use the modem selected by our parent, when it passed one that matches
+ * our command line. Otherwise, look for the modem again.
+ */
+static void udiald_dial_select_modem(struct udiald_state *state) {
+	const char *snapshot = getenv(UDIALD_SNAPSHOT_ENV);
+	struct udiald_modem m;
+	if (snapshot && udiald_modem_restore(&m, snapshot) == UDIALD_OK
+	&& (!state->filter.device_id || !strcmp(state->filter.device_id, m.device_id))
+	&& (!state->filter.profile_name || !strcmp(state->filter.profile_name, m.profile->name))) {
+		state->modem = m;
+		syslog(LOG_INFO, "%s: Using %s modem %04x:%04x selected by udiald", m.device_id,
+			m.driver, m.vendor, m.device);
+		return;
+	}
+	if (snapshot)
+		syslog(LOG_WARNING, "Ignoring invalid or mismatching modem snapshot");
+
+	udiald_modem_load_profiles(state);
 	udiald_select_modem(state);
+}
 
-	char *tty = ttyname(0);
-	if (tty && (tty = strrchr(tty, '/')))
-		tty++;
+/**
+ * Check whether an earlier dial on this modem already selected the
+ * given APN for PDP context 1 and the modem still has it.
+ */
+static bool udiald_dial_apn_unchanged(struct udiald_state *state, int fd, const char *apn) {
+	char *cached = udiald_cache_get(state, "apn");
+	bool same = cached && !strcmp(cached, apn);
+	free(cached);
+	if (!same)
+		return false;
 
-	tcflush(0, TCIFLUSH); // Skip crap
+	char want[160];
+	struct udiald_tty_read r = {0};
+	snprintf(want, sizeof(want), "+CGDCONT: 1,\"IP\",\"%s\"", apn);
+	udiald_tty_put(fd, "AT+CGDCONT?\r");
+	if (udiald_tty_get(fd, &r, NULL, 2500) != UDIALD_AT_OK)
+		return false;
+	for (size_t i = 0; i < r.lines; ++i) {
+		if (!strncasecmp(r.line[i].s, want, strlen(want)))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Prepare the modem on the given (data) tty and dial, until the modem
+ * answers CONNECT. tty is the name to use in log messages.
+ *
+ * Returns UDIALD_OK when connected, or UDIALD_EDIAL after storing the
+ * error in the udiald_dial_error_msg state option.
+ */
+int udiald_dial(struct udiald_state *state, int fd, const char *tty) {
+	udiald_tty_drain(fd); // Skip crap
 
 	char b[512];
-	struct udiald_tty_read r;
+	struct udiald_tty_read r = {0};
 
 	// Reset, unecho, ...
 	syslog(LOG_NOTICE, "%s: Preparing to dial", tty);
-	udiald_tty_put(1, "ATE0\r");
-	if (udiald_tty_get(0, &r, NULL, 2500) != UDIALD_AT_OK) {
+	udiald_tty_put(fd, "ATE0\r");
+	if (udiald_tty_get(fd, &r, NULL, 2500) != UDIALD_AT_OK) {
 		fatal_error(state, "%s: Error disabling echo (%s)",
-				   tty, (b[0]) ? b : strerror(errno));
+				   tty, r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
 		return UDIALD_EDIAL;
 	}
 	syslog(LOG_NOTICE, "%s: Echo disabled", tty);
 
 	// Reset, unecho, ...
-	udiald_tty_put(1, "ATH\r");
-	if (udiald_tty_get(0, &r, NULL, 2500) != UDIALD_AT_OK) {
+	udiald_tty_put(fd, "ATH\r");
+	if (udiald_tty_get(fd, &r, NULL, 2500) != UDIALD_AT_OK) {
 		fatal_error(state, "%s: Error resetting modem (%s)",
-				   tty, (b[0]) ? b : strerror(errno));
+				   tty, r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
 		return UDIALD_EDIAL;
 	}
 	syslog(LOG_NOTICE, "%s: Modem reset", tty);
@@ -77,7 +133,7 @@ int udiald_dial_main(struct udiald_state *state) {
 	char *apn = udiald_config_get(state, "udiald_apn");
 
 	if (!apn)
-		apn = "";
+		apn = strdup("");
 
 	char *invalid = strpbrk(apn, "\"\r\n;");
 	if (invalid) {
@@ -90,27 +146,58 @@ int udiald_dial_main(struct udiald_state *state) {
 
 		fatal_error(state,  "%s: Invalid character in APN: '%s'",
 				    tty, invalid);
+		free(apn);
 		return UDIALD_EDIAL;
 	}
 
-	snprintf(b, sizeof(b), "AT+CGDCONT=1,\"IP\",\"%s\"\r", apn);
-
 	if (!*apn)
 		syslog(LOG_WARNING, "%s: No apn configured, connection might not work", tty);
 
-	udiald_tty_put(1, b);
-	if (udiald_tty_get(0, &r, NULL, 2500) != UDIALD_AT_OK) {
-		fatal_error(state,  "%s: Failed to set APN (%s)",
-				    tty, r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
-		return UDIALD_EDIAL;
+	if (udiald_dial_apn_unchanged(state, fd, apn)) {
+		syslog(LOG_NOTICE, "%s: APN \"%s\" already selected. Now dialing...", tty, apn);
+	} else {
+		snprintf(b, sizeof(b), "AT+CGDCONT=1,\"IP\",\"%s\"\r", apn);
+		udiald_tty_put(fd, b);
+		if (udiald_tty_get(fd, &r, NULL, 2500) != UDIALD_AT_OK) {
+			udiald_cache_set(state, "apn", NULL);
+			fatal_error(state,  "%s: Failed to set APN (%s)",
+					    tty, r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
+			free(apn);
+			return UDIALD_EDIAL;
+		}
+		udiald_cache_set(state, "apn", apn);
+		syslog(LOG_NOTICE, "%s: Selected APN \"%s\". Now dialing...", tty, apn);
 	}
-	syslog(LOG_NOTICE, "%s: Selected APN \"%s\". Now dialing...", tty, apn);
 	free(apn);
 
-	// Dial
+	// Dial, as soon as the modem is registered to the network. Modems
+	// that cannot tell us just get a few seconds between attempts.
 	enum udiald_atres res = UDIALD_AT_NOCARRIER;
-	for (int i = 0; i < 9; ++i) { // Wait 9 * 5s for network
-		tcflush(0, TCIFLUSH);
+	udiald_config_revert(state, "udiald_dial_attempt");
+	bool can_wait = true;
+	for (int i = 0; i < UDIALD_DIAL_ATTEMPTS; ++i) {
+		uint64_t start = udiald_util_monotonic_ms();
+		bool registered = false;
+		if (can_wait) {
+			int timeout = i ? UDIALD_DIAL_RETRY_TIMEOUT : UDIALD_DIAL_NETWORK_TIMEOUT;
+			if (udiald_reg_wait(fd, state->modem.profile->cfg.maxcmdlen, timeout) == 0) {
+				registered = true;
+			} else if (errno == ENOTSUP) {
+				syslog(LOG_INFO, "%s: Modem does not report registration", tty);
+				can_wait = false;
+			}
+		}
+		if (!can_wait && i)
+			sleep(UDIALD_DIAL_RETRY_TIMEOUT / 1000);
+		// Give up when told to stop while waiting
+		if (udiald_tty_interrupted) {
+			r.lines = 0;
+			errno = EINTR;
+			break;
+		}
+
+		udiald_tty_drain(fd);
+		uint64_t dial_start = udiald_util_monotonic_ms();
 		// Linux Driver 4.19.19.00 Tool User Guide.pdf inside
 		// HUAWEI Data Cards Linux Driver suggests that ATD*99#
 		// should generally work for WCDMA and GSM, but ATD#777
@@ -120,12 +207,26 @@ int udiald_dial_main(struct udiald_state *state) {
 		// command (ATD is legacy but possibly supported by more
 		// modems).
 		syslog(LOG_INFO, "%s: Using dial command: %s", tty, state->modem.profile->cfg.dialcmd);
-		udiald_tty_put(1, state->modem.profile->cfg.dialcmd);
-		res = udiald_tty_get(0, &r, NULL, 10000);
+		udiald_tty_put(fd, state->modem.profile->cfg.dialcmd);
+		res = udiald_tty_get(fd, &r, NULL, 10000);
+
+		// Keep track of where the time went
+		uint64_t end = udiald_util_monotonic_ms();
+		snprintf(b, sizeof(b), "%d %u %u %s %s", i + 1,
+			(unsigned int)(dial_start - start), (unsigned int)(end - dial_start),
+			registered ? "registered" : "unregistered",
+			r.lines ? udiald_tty_flatten_result(&r) : "timeout");
+		udiald_config_append(state, "udiald_dial_attempt", b);
+		syslog(LOG_INFO, "%s: Dial attempt %d: waited %u ms for the network, dialing took %u ms",
+			tty, i + 1, (unsigned int)(dial_start - start), (unsigned int)(end - dial_start));
+
 		if (res != UDIALD_AT_NOCARRIER && res != UDIALD_AT_OK)
 			break;
 		syslog(LOG_NOTICE, "%s: No carrier. Waiting for network...", tty);
-		sleep(5);
+		// Don't redial in a tight loop when the modem says it is
+		// registered but still won't connect
+		if (registered)
+			sleep(1);
 	}
 
 	if (res != UDIALD_AT_CONNECT) {
@@ -134,9 +235,22 @@ int udiald_dial_main(struct udiald_state *state) {
 		return UDIALD_EDIAL;
 	}
 
-	udiald_config_set(state, "udiald_state", "connected");
-	ucix_save(state->uci, state->uciname);
+	syslog(LOG_INFO, "%s: Dial command answered after %u ms", tty, r.latency_ms);
+
+	udiald_var_set(state, UDIALD_VAR_STATE, "connected");
+	udiald_var_commit(state);
 
 	syslog(LOG_NOTICE, "%s: Connected. Handover to pppd.", tty);
 	return UDIALD_OK;
 }
+
+int udiald_dial_main(struct udiald_state *state) {
+	udiald_dial_select_modem(state);
+
+	char *tty = ttyname(0);
+	if (tty && (tty = strrchr(tty, '/')))
+		tty++;
+
+	// pppd gives us the tty opened read-write on stdin and stdout
+	return udiald_dial(state, 0, tty);
+}
@@ -0,0 +1,322 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * History of the link status (signal strength, access technology,
+ * provider, registration and whether we were connected), kept in
+ * memory in fixed size rings at two resolutions:
+ *
+ *  - every UDIALD_HISTORY_INTERVAL (15 s) for the last hour
+ *  - every UDIALD_HISTORY_COARSE samples (5 min) for the last day
+ *
+ * Samples are taken from the var store (see var.c) while udiald runs
+ * its event loop (connected or standing by). Coarse samples summarize
+ * the fine samples in their interval: the average, lowest and highest
+ * rssi, the worst ber, the last access technology, registration and
+ * provider, and the part of the time we were connected.
+ *
+ * Strings are stored once, in a small table of names, and referred to
+ * by index, so a sample has a fixed size.
+ *
+ * The history is never written to disk by itself. It can be read
+ * through ubus (as json, see ubus.c) or dumped in a binary format (see
+ * udiald_history_dump and tools/udiald-history.py).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+
+// Interval between samples, in ms
+#define UDIALD_HISTORY_INTERVAL 15000
+// Fine samples per coarse sample
+#define UDIALD_HISTORY_COARSE 20
+// Number of samples kept (an hour and a day)
+#define UDIALD_HISTORY_FINE_SAMPLES 240
+#define UDIALD_HISTORY_COARSE_SAMPLES 288
+
+#define UDIALD_HISTORY_NAMES 32
+#define UDIALD_HISTORY_NAMELEN 32
+// Name index for no value, and for a name that did not fit the table
+#define UDIALD_HISTORY_NONE 0xff
+#define UDIALD_HISTORY_OTHER 0xfe
+
+// Header of the binary dump, see udiald_history_dump
+#define UDIALD_HISTORY_MAGIC "UDHS"
+#define UDIALD_HISTORY_VERSION 1
+
+// rssi and ber when not known, as in +CSQ
+#define UDIALD_HISTORY_UNKNOWN 99
+
+struct udiald_history_sample {
+	uint32_t time; /* Time of the (last) sample, seconds since the epoch */
+	uint8_t rssi; /* Average, on the +CSQ scale */
+	uint8_t rssi_min;
+	uint8_t rssi_max;
+	uint8_t ber; /* Highest (worst) */
+	uint8_t rat; /* Name index of the access technology */
+	uint8_t reg; /* Name index of the registration */
+	uint8_t provider; /* Name index of the provider */
+	uint8_t connected; /* Percentage of the time we were connected */
+};
+
+struct udiald_history_ring {
+	uint32_t interval; /* Seconds between samples */
+	uint32_t size;
+	uint32_t head; /* Number of samples ever added */
+	struct udiald_history_sample *s;
+};
+
+static struct udiald_history_sample fine_samples[UDIALD_HISTORY_FINE_SAMPLES];
+static struct udiald_history_sample coarse_samples[UDIALD_HISTORY_COARSE_SAMPLES];
+
+static struct udiald_history_ring rings[] = {
+	{UDIALD_HISTORY_INTERVAL / 1000, UDIALD_HISTORY_FINE_SAMPLES, 0, fine_samples},
+	{UDIALD_HISTORY_INTERVAL / 1000 * UDIALD_HISTORY_COARSE, UDIALD_HISTORY_COARSE_SAMPLES, 0, coarse_samples},
+};
+
+static char names[UDIALD_HISTORY_NAMES][UDIALD_HISTORY_NAMELEN];
+static unsigned int nnames;
+
+// Fine samples since the last coarse sample
+static struct {
+	unsigned int n, rssi_n, connected_n;
+	unsigned int rssi_sum;
+	struct udiald_history_sample s;
+} acc;
+
+static struct udiald_state *history_state;
+static char historyfile[128];
+
+static void udiald_history_timer(struct uloop_timeout *t);
+static struct uloop_timeout timer = {.cb = udiald_history_timer};
+
+/**
+ * Set the file udiald_history_dump writes to by default.
+ */
+void udiald_history_set_file(const char *path) {
+	strncpy(historyfile, path, sizeof(historyfile) - 1);
+}
+
+static uint8_t udiald_history_name(const char *name) {
+	if (!name)
+		return UDIALD_HISTORY_NONE;
+	for (unsigned int i = 0; i < nnames; ++i) {
+		if (!strncmp(names[i], name, UDIALD_HISTORY_NAMELEN - 1))
+			return i;
+	}
+	if (nnames == UDIALD_HISTORY_NAMES)
+		return UDIALD_HISTORY_OTHER;
+	strncpy(names[nnames], name, UDIALD_HISTORY_NAMELEN - 1);
+	return nnames++;
+}
+
+static uint8_t udiald_history_num(struct udiald_state *state, enum udiald_var_id id) {
+	const char *val = udiald_var_get(state, id);
+	int n = val ? atoi(val) : UDIALD_HISTORY_UNKNOWN;
+	return (n < 0 || n > UDIALD_HISTORY_UNKNOWN) ? UDIALD_HISTORY_UNKNOWN : n;
+}
+
+static void udiald_history_add(struct udiald_history_ring *r, const struct udiald_history_sample *s) {
+	r->s[r->head++ % r->size] = *s;
+}
+
+/**
+ * Take a sample of the current status.
+ */
+void udiald_history_sample(struct udiald_state *state) {
+	struct udiald_history_sample s = {
+		.time = time(NULL),
+		.rssi = udiald_history_num(state, UDIALD_VAR_RSSI),
+		.ber = udiald_history_num(state, UDIALD_VAR_BER),
+		.rat = udiald_history_name(udiald_var_get(state, UDIALD_VAR_RAT)),
+		.reg = udiald_history_name(udiald_var_get(state, UDIALD_VAR_REGISTRATION)),
+		.provider = udiald_history_name(udiald_var_get(state, UDIALD_VAR_PROVIDER)),
+		.connected = udiald_var_get(state, UDIALD_VAR_CONNECTED) ? 100 : 0,
+	};
+	s.rssi_min = s.rssi_max = s.rssi;
+	udiald_history_add(&rings[0], &s);
+
+	// Summarize into the next coarse sample
+	if (!acc.n) {
+		acc.s = s;
+		acc.s.ber = UDIALD_HISTORY_UNKNOWN;
+	}
+	acc.n++;
+	if (s.rssi != UDIALD_HISTORY_UNKNOWN) {
+		if (!acc.rssi_n || s.rssi < acc.s.rssi_min)
+			acc.s.rssi_min = s.rssi;
+		if (!acc.rssi_n || s.rssi > acc.s.rssi_max)
+			acc.s.rssi_max = s.rssi;
+		acc.rssi_sum += s.rssi;
+		acc.rssi_n++;
+	}
+	// 0-7, higher is worse
+	if (s.ber != UDIALD_HISTORY_UNKNOWN && (acc.s.ber == UDIALD_HISTORY_UNKNOWN || s.ber > acc.s.ber))
+		acc.s.ber = s.ber;
+	if (s.connected)
+		acc.connected_n++;
+	acc.s.time = s.time;
+	acc.s.rat = s.rat;
+	acc.s.reg = s.reg;
+	acc.s.provider = s.provider;
+
+	if (acc.n == UDIALD_HISTORY_COARSE) {
+		acc.s.rssi = acc.rssi_n ? (acc.rssi_sum + acc.rssi_n / 2) / acc.rssi_n : UDIALD_HISTORY_UNKNOWN;
+		acc.s.connected = acc.connected_n * 100 / acc.n;
+		udiald_history_add(&rings[1], &acc.s);
+		memset(&acc, 0, sizeof(acc));
+	}
+}
+
+static void udiald_history_timer(struct uloop_timeout *t) {
+	udiald_history_sample(history_state);
+	uloop_timeout_set(&timer, UDIALD_HISTORY_INTERVAL);
+}
+
+/**
+ * Take samples from the uloop event loop. Call this after every
+ * uloop_init, and udiald_history_stop before uloop_done. Samples are
+ * not taken outside of the event loop (e.g. while dialing).
+ */
+void udiald_history_start(struct udiald_state *state) {
+	history_state = state;
+	uloop_timeout_set(&timer, UDIALD_HISTORY_INTERVAL);
+}
+
+void udiald_history_stop(void) {
+	uloop_timeout_cancel(&timer);
+}
+
+static const char *udiald_history_namestr(uint8_t i) {
+	if (i == UDIALD_HISTORY_NONE)
+		return "";
+	if (i == UDIALD_HISTORY_OTHER)
+		return "other";
+	return names[i];
+}
+
+/**
+ * Add the history to a blob, as:
+ *
+ *   {"fields": ["time", "rssi", ...],
+ *    "history": [{"interval": 15, "samples": [[1381845000, 17, ...], ...]}, ...]}
+ *
+ * Samples are arrays with the values in the order of fields, oldest
+ * first. Names are given as strings, rssi and ber are 99 when unknown.
+ */
+void udiald_history_add_blob(struct blob_buf *b) {
+	static const char *fields[] = {
+		"time", "rssi", "rssi_min", "rssi_max", "ber", "rat", "registration", "provider", "connected",
+	};
+	void *c = blobmsg_open_array(b, "fields");
+	for (size_t i = 0; i < lengthof(fields); ++i)
+		blobmsg_add_string(b, NULL, fields[i]);
+	blobmsg_close_array(b, c);
+
+	void *h = blobmsg_open_array(b, "history");
+	for (size_t i = 0; i < lengthof(rings); ++i) {
+		const struct udiald_history_ring *r = &rings[i];
+		void *t = blobmsg_open_table(b, NULL);
+		blobmsg_add_u32(b, "interval", r->interval);
+		void *a = blobmsg_open_array(b, "samples");
+		uint32_t j = (r->head > r->size) ? r->head - r->size : 0;
+		for (; j != r->head; ++j) {
+			const struct udiald_history_sample *s = &r->s[j % r->size];
+			void *e = blobmsg_open_array(b, NULL);
+			blobmsg_add_u32(b, NULL, s->time);
+			blobmsg_add_u32(b, NULL, s->rssi);
+			blobmsg_add_u32(b, NULL, s->rssi_min);
+			blobmsg_add_u32(b, NULL, s->rssi_max);
+			blobmsg_add_u32(b, NULL, s->ber);
+			blobmsg_add_string(b, NULL, udiald_history_namestr(s->rat));
+			blobmsg_add_string(b, NULL, udiald_history_namestr(s->reg));
+			blobmsg_add_string(b, NULL, udiald_history_namestr(s->provider));
+			blobmsg_add_u32(b, NULL, s->connected);
+			blobmsg_close_array(b, e);
+		}
+		blobmsg_close_array(b, a);
+		blobmsg_close_table(b, t);
+	}
+	blobmsg_close_array(b, h);
+}
+
+static bool udiald_history_write(int fd, const void *data, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n <= 0)
+			return false;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Write the history to path (or the file set with
+ * udiald_history_set_file) in binary form, in host byte order:
+ *
+ *   "UDHS", uint32 version, uint32 sample size, uint32 names, uint32 rings
+ *   names, UDIALD_HISTORY_NAMELEN bytes each (nul padded)
+ *   per ring: uint32 interval, uint32 samples, then the samples, oldest
+ *   first (see struct udiald_history_sample)
+ *
+ * Name index 0xff means no value, 0xfe a name that did not fit.
+ *
+ * Only uses async-signal-safe functions, so this can be called from a
+ * signal handler. Returns 0 on success, -1 on failure.
+ */
+int udiald_history_dump(const char *path) {
+	if (!path)
+		path = historyfile;
+	if (!path[0])
+		return -1;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	unsigned int n = nnames;
+	uint32_t header[] = {UDIALD_HISTORY_VERSION, sizeof(struct udiald_history_sample), n, lengthof(rings)};
+	bool ok = udiald_history_write(fd, UDIALD_HISTORY_MAGIC, 4)
+		&& udiald_history_write(fd, header, sizeof(header))
+		&& udiald_history_write(fd, names, n * UDIALD_HISTORY_NAMELEN);
+
+	for (size_t i = 0; ok && i < lengthof(rings); ++i) {
+		const struct udiald_history_ring *r = &rings[i];
+		uint32_t head = r->head;
+		uint32_t count = (head > r->size) ? r->size : head;
+		uint32_t first = (head - count) % r->size;
+		uint32_t ring_header[] = {r->interval, count};
+		// Oldest first, that is from first to the end of the array
+		// and then from the start
+		uint32_t part = (first + count > r->size) ? r->size - first : count;
+		ok = udiald_history_write(fd, ring_header, sizeof(ring_header))
+			&& udiald_history_write(fd, &r->s[first], part * sizeof(*r->s))
+			&& udiald_history_write(fd, r->s, (count - part) * sizeof(*r->s));
+	}
+	close(fd);
+	return ok ? 0 : -1;
+}
@@ -30,6 +30,9 @@
 
 #define UDIALD_SYS_USB_DEVICES "/sys/bus/usb/devices/*"
 
+// Bump when changing the snapshot format
+#define UDIALD_SNAPSHOT_VERSION 1
+
 static const char *modestr[] = {
 	[UDIALD_MODE_AUTO] = "auto",
 	[UDIALD_FORCE_UMTS] = "force_umts",
@@ -51,6 +54,16 @@ enum udiald_mode udiald_modem_modeval(const char *mode) {
 	return -1;
 }
 
+static const char *datapathstr[] = {
+	[UDIALD_DATAPATH_PPP] = "ppp",
+	[UDIALD_DATAPATH_NCM] = "ncm",
+};
+
+// Names of the signal queries, in the order of their bits
+static const char *signalstr[] = {
+	"cesq", "hcsq", "csnr", "zrssi", "gstatus",
+};
+
 
 /**
  * Check if the given profile matches the given modem (or, if a name is
@@ -138,7 +151,8 @@ int udiald_modem_find_devices(const struct udiald_state *state, struct udiald_mo
 	bool found = false;
 	glob_t gl;
 	char buf[PATH_MAX + 1];
-	int e = udiald_util_checked_glob(UDIALD_SYS_USB_DEVICES, GLOB_NOSORT, &gl, "listing USB devices");
+	snprintf(buf, sizeof(buf), "%s%s", state->sysroot, UDIALD_SYS_USB_DEVICES);
+	int e = udiald_util_checked_glob(buf, GLOB_NOSORT, &gl, "listing USB devices");
 	if (e) return e;
 
 	for (size_t i = 0; i < gl.gl_pathc; ++i) {
@@ -268,6 +282,17 @@ static struct json_object *profile_to_json(const struct udiald_profile *p) {
 	}
 	json_object_object_add(obj, "modes", modes);
 	json_object_object_add(obj, "dialcmd", json_object_new_string(p->cfg.dialcmd));
+	if (p->cfg.maxcmdlen)
+		json_object_object_add(obj, "maxcmdlen", json_object_new_int(p->cfg.maxcmdlen));
+	json_object_object_add(obj, "datapath", json_object_new_string(datapathstr[p->cfg.datapath]));
+	if (p->cfg.signal) {
+		struct json_object *signal = json_object_new_array();
+		for (size_t i = 0; i < lengthof(signalstr); ++i) {
+			if (p->cfg.signal & (1 << i))
+				json_object_array_add(signal, json_object_new_string(signalstr[i]));
+		}
+		json_object_object_add(obj, "signal", signal);
+	}
 
 	return obj;
 }
@@ -306,31 +331,109 @@ static void display_device(struct udiald_modem *modem, void *data) {
 }
 
 /**
- * Detect (potentially) usable devices and list them on stdout.
+ * Detect (potentially) usable devices and return them in *devices, as a
+ * json object with the device ids as keys. Returns the result of
+ * udiald_modem_find_devices.
  */
-int udiald_modem_list_devices(const struct udiald_state *state, struct udiald_device_filter *filter) {
-	syslog(LOG_NOTICE, "Listing usable devices");
+int udiald_modem_devices_json(const struct udiald_state *state, struct udiald_device_filter *filter, struct json_object **devices) {
 	/* Allocate some storage for udiald_modem_find_devices to work */
 	struct udiald_modem modem;
 	struct device_display_data data = {
-		.format = state->format,
+		.format = UDIALD_FORMAT_JSON,
+		.data.dict = json_object_new_object(),
 	};
-	if (state->format == UDIALD_FORMAT_JSON)
-		data.data.dict = json_object_new_object();
-
 	int e = udiald_modem_find_devices(state, &modem, display_device, &data, filter);
+	*devices = data.data.dict;
+	return e;
+}
+
+/**
+ * Detect (potentially) usable devices and list them on stdout.
+ */
+int udiald_modem_list_devices(const struct udiald_state *state, struct udiald_device_filter *filter) {
+	syslog(LOG_NOTICE, "Listing usable devices");
+	struct json_object *dict = NULL;
+	int e;
+	if (state->format == UDIALD_FORMAT_JSON) {
+		e = udiald_modem_devices_json(state, filter, &dict);
+	} else {
+		struct udiald_modem modem;
+		struct device_display_data data = {
+			.format = state->format,
+		};
+		e = udiald_modem_find_devices(state, &modem, display_device, &data, filter);
+	}
 	if (e == UDIALD_ENODEV) {
 		syslog(LOG_NOTICE, "No devices found");
 	} else if (e != UDIALD_OK) {
 		syslog(LOG_ERR, "Error while detecting devices");
 	}
-	if (state->format == UDIALD_FORMAT_JSON) {
-		printf("%s\n", json_object_to_json_string_ext(data.data.dict, JSON_C_TO_STRING_PRETTY));
-		json_object_put(data.data.dict);
+	if (dict) {
+		printf("%s\n", json_object_to_json_string_ext(dict, JSON_C_TO_STRING_PRETTY));
+		json_object_put(dict);
 	}
 	return e;
 }
 
+/**
+ * Serialize the selected modem, together with the parts of its profile
+ * the dialer needs, into buf. This is passed to the dialer (in the
+ * UDIALD_SNAPSHOT environment variable), so it can skip looking for
+ * the modem again.
+ *
+ * Fields are separated by tabs. The dial command comes last, since it
+ * is the only free-form field.
+ *
+ * Returns UDIALD_OK, or UDIALD_EINVAL when the snapshot does not fit in
+ * buf or a field contains a tab.
+ */
+int udiald_modem_snapshot(const struct udiald_modem *modem, char *buf, size_t len) {
+	const struct udiald_profile *p = modem->profile;
+	if (strchr(p->name, '\t') || strchr(modem->driver, '\t'))
+		return UDIALD_EINVAL;
+
+	int n = snprintf(buf, len, "%d\t%04x\t%04x\t%s\t%s\t%s\t%s\t%zu\t%s\t%u\t%u\t%zu\t%s",
+		UDIALD_SNAPSHOT_VERSION, modem->vendor, modem->device, modem->driver,
+		modem->device_id, modem->ctl_tty, modem->dat_tty, modem->num_ttys,
+		p->name, p->cfg.ctlidx, p->cfg.datidx, p->cfg.maxcmdlen, p->cfg.dialcmd);
+	if (n < 0 || (size_t)n >= len)
+		return UDIALD_EINVAL;
+	return UDIALD_OK;
+}
+
+/**
+ * Restore a modem from a snapshot made by udiald_modem_snapshot. The
+ * profile is a private copy that only contains what the snapshot has,
+ * so this is only good enough for dialing.
+ *
+ * Returns UDIALD_OK, or UDIALD_EINVAL when the snapshot is invalid or
+ * from a different version.
+ */
+int udiald_modem_restore(struct udiald_modem *modem, const char *snapshot) {
+	static struct udiald_profile p;
+	static char name[64];
+	int version, n = -1;
+	unsigned int ctlidx, datidx;
+	struct udiald_modem m = {0};
+
+	if (sscanf(snapshot, "%d\t%hx\t%hx\t%31[^\t]\t%31[^\t]\t%15[^\t]\t%15[^\t]\t%zu\t%63[^\t]\t%u\t%u\t%zu\t%n",
+			&version, &m.vendor, &m.device, m.driver, m.device_id,
+			m.ctl_tty, m.dat_tty, &m.num_ttys, name, &ctlidx, &datidx,
+			&p.cfg.maxcmdlen, &n) != 12 || n < 0 || version != UDIALD_SNAPSHOT_VERSION)
+		return UDIALD_EINVAL;
+
+	free(p.cfg.dialcmd);
+	p.name = p.desc = name;
+	p.vendor = m.vendor;
+	p.device = m.device;
+	p.cfg.ctlidx = ctlidx;
+	p.cfg.datidx = datidx;
+	p.cfg.dialcmd = strdup(snapshot + n);
+	m.profile = &p;
+	*modem = m;
+	return UDIALD_OK;
+}
+
 /* Parse a single uci section of type udiald_profile into a profile */
 static int udiald_modem_parse_profile(const struct uci_section *s, struct udiald_profile *p) {
 	p->name = strdup(s->e.name);
@@ -351,6 +454,35 @@ static int udiald_modem_parse_profile(const struct uci_section *s, struct udiald
 			p->cfg.datidx = strtoul(o->v.string, NULL, 10);
 		else if (!strcmp(o->e.name, "dialcmd"))
 			asprintf(&p->cfg.dialcmd, "%s\r", o->v.string);
+		else if (!strcmp(o->e.name, "maxcmdlen"))
+			p->cfg.maxcmdlen = strtoul(o->v.string, NULL, 10);
+		else if (!strcmp(o->e.name, "datapath")) {
+			size_t i;
+			for (i = 0; i < lengthof(datapathstr); ++i) {
+				if (!strcmp(o->v.string, datapathstr[i])) {
+					p->cfg.datapath = i;
+					break;
+				}
+			}
+			if (i == lengthof(datapathstr))
+				syslog(LOG_WARNING, "Uci section %s has unknown datapath, using ppp: %s", s->e.name, o->v.string);
+		}
+		else if (!strcmp(o->e.name, "signal")) {
+			/* Space separated query names */
+			char *list = strdup(o->v.string), *save;
+			for (char *n = strtok_r(list, " ", &save); n; n = strtok_r(NULL, " ", &save)) {
+				size_t i;
+				for (i = 0; i < lengthof(signalstr); ++i) {
+					if (!strcmp(n, signalstr[i])) {
+						p->cfg.signal |= 1 << i;
+						break;
+					}
+				}
+				if (i == lengthof(signalstr))
+					syslog(LOG_WARNING, "Uci section %s has unknown signal query, ignoring: %s", s->e.name, n);
+			}
+			free(list);
+		}
 		else if (!strcmp(o->e.name, "vendor")) {
 			p->vendor = strtoul(o->v.string, NULL, 16);
 			p->flags &= ~UDIALD_PROFILE_NOVENDOR;
@@ -415,30 +547,35 @@ int udiald_modem_load_profiles(struct udiald_state *state) {
 }
 
 /**
- * Output a list of all known profiles on stdout.
+ * Return all known profiles as a json object, with the profile names as
+ * keys.
  */
-int udiald_modem_list_profiles(const struct udiald_state *state) {
+struct json_object *udiald_modem_profiles_json(const struct udiald_state *state) {
 	struct udiald_profile_list *l;
-	struct json_object *dict = NULL;
-	if (state->format == UDIALD_FORMAT_JSON)
-		dict = json_object_new_object();
-	list_for_each_entry(l, &state->custom_profiles, h) {
-		if (state->format == UDIALD_FORMAT_JSON)
-			json_object_object_add(dict, l->p.name, profile_to_json(&l->p));
-		else
-			printf("%s\n", l->p.name);
-	}
+	struct json_object *dict = json_object_new_object();
+	list_for_each_entry(l, &state->custom_profiles, h)
+		json_object_object_add(dict, l->p.name, profile_to_json(&l->p));
 
-	for (size_t i = 0; i < (sizeof(profiles) / sizeof(*profiles)); ++i) {
-		const struct udiald_profile *p = &profiles[i];
-		if (state->format == UDIALD_FORMAT_JSON)
-			json_object_object_add(dict, p->name, profile_to_json(p));
-		else
-			printf("%s\n", p->name);
-	}
+	for (size_t i = 0; i < (sizeof(profiles) / sizeof(*profiles)); ++i)
+		json_object_object_add(dict, profiles[i].name, profile_to_json(&profiles[i]));
+	return dict;
+}
+
+/**
+ * Output a list of all known profiles on stdout.
+ */
+int udiald_modem_list_profiles(const struct udiald_state *state) {
 	if (state->format == UDIALD_FORMAT_JSON) {
+		struct json_object *dict = udiald_modem_profiles_json(state);
 		printf("%s\n", json_object_to_json_string_ext(dict, JSON_C_TO_STRING_PRETTY));
 		json_object_put(dict);
+		return 0;
 	}
+
+	struct udiald_profile_list *l;
+	list_for_each_entry(l, &state->custom_profiles, h)
+		printf("%s\n", l->p.name);
+	for (size_t i = 0; i < (sizeof(profiles) / sizeof(*profiles)); ++i)
+		printf("%s\n", profiles[i].name);
 	return 0;
 }
@@ -0,0 +1,454 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * NCM data path for Huawei modems. Instead of dialing on the data tty
+ * and running pppd, the connection is started with AT^NDISDUP on the
+ * control tty, after which the modem routes packets through its
+ * cdc_ncm / huawei_cdc_ncm network interface. That interface is
+ * configured by a DHCP client, or from the AT^DHCP? reply.
+ */
+
+#define _GNU_SOURCE // Get environ
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+#include "config.h"
+
+// How long the modem gets to set up the connection after AT^NDISDUP,
+// in ms
+#define UDIALD_NCM_CONNECT_TIMEOUT 30000
+// How long to wait for network registration before connecting, in ms
+#define UDIALD_NCM_NETWORK_TIMEOUT 45000
+
+// Network interface of the current session
+static char ncm_ifname[IFNAMSIZ];
+// Last connection status the modem reported (^NDISSTAT URC)
+static int ncm_stat = -1;
+// The modem reported the connection as gone during the session
+static bool ncm_lost;
+static bool ncm_active;
+
+/**
+ * Parse the IPv4 connection status from a ^NDISSTAT URC or a
+ * ^NDISSTATQRY reply ("^NDISSTAT: <stat>[,<err>,<wx_state>,<type>]",
+ * where stat 1 means connected). Modems that also do IPv6 send a
+ * separate URC for it, with type "IPV6", and repeat the fields in the
+ * query reply, but the IPv4 status comes first. A missing type is
+ * taken as IPv4.
+ *
+ * Returns the status, or -1 when the line cannot be parsed or is not
+ * about IPv4.
+ */
+static int udiald_ncm_parse_stat(const char *line) {
+	const char *p = strchr(line, ':');
+	if (!p)
+		return -1;
+	char *end;
+	long stat = strtol(p + 1, &end, 10);
+	if (end == p + 1 || stat < 0)
+		return -1;
+
+	// Skip to the type, which is the fourth field
+	p = end;
+	for (int i = 0; i < 3 && p; ++i) {
+		p = strchr(p, ',');
+		if (p)
+			++p;
+	}
+	if (p) {
+		p += strspn(p, " \"");
+		if (*p && *p != ',' && strncasecmp(p, "IPV4", 4))
+			return -1;
+	}
+	return stat;
+}
+
+static void udiald_ncm_urc(struct udiald_urc_handler *h, const char *line) {
+	int stat = udiald_ncm_parse_stat(line);
+	if (stat < 0)
+		return;
+	ncm_stat = stat;
+	if (ncm_active && stat != 1) {
+		syslog(LOG_NOTICE, "%s: Modem reports the connection is gone (%s)", ncm_ifname, line);
+		ncm_lost = true;
+		// Ends the status loop, if it is running
+		uloop_end();
+	}
+}
+
+static struct udiald_urc_handler ncm_handler = {
+	.prefix = "^NDISSTAT:",
+	.cb = udiald_ncm_urc,
+};
+
+/**
+ * Find the NCM network interface of the modem, i.e. the net device
+ * below one of its USB interfaces that is bound to cdc_ncm or
+ * huawei_cdc_ncm.
+ *
+ * Returns UDIALD_OK with the interface name in ifname, or UDIALD_ENODEV.
+ */
+static int udiald_ncm_find_netdev(const struct udiald_state *state, char *ifname, size_t size) {
+	char buf[PATH_MAX];
+	glob_t gl;
+	snprintf(buf, sizeof(buf), "%s/sys/bus/usb/devices/%s/%s:*/net/*",
+		state->sysroot, state->modem.device_id, state->modem.device_id);
+	if (udiald_util_checked_glob(buf, 0, &gl, "listing network interfaces"))
+		return UDIALD_ENODEV;
+
+	int ret = UDIALD_ENODEV;
+	for (size_t i = 0; i < gl.gl_pathc && ret != UDIALD_OK; ++i) {
+		char *net = strrchr(gl.gl_pathv[i], '/');
+		*net = '\0';
+		// Chop off "/net" as well, to get the USB interface
+		*strrchr(gl.gl_pathv[i], '/') = '\0';
+
+		char driver[32];
+		snprintf(buf, sizeof(buf), "%s/driver", gl.gl_pathv[i]);
+		udiald_util_read_symlink_basename(buf, driver, sizeof(driver));
+		if (strcmp(driver, "cdc_ncm") && strcmp(driver, "huawei_cdc_ncm")) {
+			syslog(LOG_DEBUG, "%s: Skipping interface %s (driver \"%s\")", state->modem.device_id, net + 1, driver);
+			continue;
+		}
+		snprintf(ifname, size, "%s", net + 1);
+		syslog(LOG_INFO, "%s: Using network interface %s (driver \"%s\")", state->modem.device_id, ifname, driver);
+		ret = UDIALD_OK;
+	}
+	globfree(&gl);
+	return ret;
+}
+
+/**
+ * Do a SIOCxIF* ioctl for the given interface on a throwaway socket.
+ */
+static int udiald_ncm_ioctl(unsigned long req, void *arg) {
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	int ret = ioctl(sock, req, arg);
+	int err = errno;
+	close(sock);
+	errno = err;
+	return ret;
+}
+
+/**
+ * Bring the given interface up or down.
+ */
+static int udiald_ncm_set_up(const char *ifname, bool up) {
+	struct ifreq ifr = {0};
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if (udiald_ncm_ioctl(SIOCGIFFLAGS, &ifr))
+		return -1;
+	if (up)
+		ifr.ifr_flags |= IFF_UP;
+	else
+		ifr.ifr_flags &= ~IFF_UP;
+	return udiald_ncm_ioctl(SIOCSIFFLAGS, &ifr);
+}
+
+/**
+ * Convert an address from a ^DHCP reply, which is printed as a hex
+ * number with the first octet in the lowest byte (e.g. "0d01a8c0" for
+ * 192.168.1.13).
+ */
+static struct in_addr udiald_ncm_addr(uint32_t v) {
+	struct in_addr a;
+	uint8_t b[4] = {v, v >> 8, v >> 16, v >> 24};
+	memcpy(&a.s_addr, b, sizeof(b));
+	return a;
+}
+
+static int udiald_ncm_set_addr(const char *ifname, unsigned long req, struct in_addr addr) {
+	struct ifreq ifr = {0};
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	sin->sin_family = AF_INET;
+	sin->sin_addr = addr;
+	return udiald_ncm_ioctl(req, &ifr);
+}
+
+/**
+ * Configure the interface from the AT^DHCP? reply, which has the
+ * address, netmask, gateway, DHCP server and two DNS servers the
+ * network assigned. The address, gateway and DNS servers are put in the
+ * uci state as well, for scripts that set up DNS.
+ *
+ * Returns UDIALD_OK, or an error code with a description in *msg.
+ */
+static int udiald_ncm_static(struct udiald_state *state, const char **msg) {
+	struct udiald_tty_read r = {0};
+	unsigned int v[6];
+
+	udiald_tty_put(state->ctlfd, "AT^DHCP?\r");
+	if (udiald_tty_get(state->ctlfd, &r, "^DHCP:", 2500) != UDIALD_AT_OK || !r.result_line
+	|| sscanf(r.result_line, "^DHCP: %x,%x,%x,%x,%x,%x", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6) {
+		syslog(LOG_ERR, "%s: Failed to get the IP configuration (%s)", state->modem.device_id,
+			r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
+		*msg = "Failed to get the IP configuration";
+		return UDIALD_EMODEM;
+	}
+
+	struct in_addr addr = udiald_ncm_addr(v[0]), mask = udiald_ncm_addr(v[1]), gw = udiald_ncm_addr(v[2]);
+	if (udiald_ncm_set_addr(ncm_ifname, SIOCSIFADDR, addr)
+	|| udiald_ncm_set_addr(ncm_ifname, SIOCSIFNETMASK, mask)) {
+		syslog(LOG_ERR, "%s: Failed to set the address: %s", ncm_ifname, strerror(errno));
+		*msg = "Failed to configure the network interface";
+		return UDIALD_EINTERNAL;
+	}
+
+	if (udiald_config_get_int(state, "defaultroute", 1)) {
+		struct rtentry rt = {0};
+		struct sockaddr_in *dst = (struct sockaddr_in *)&rt.rt_dst;
+		struct sockaddr_in *gateway = (struct sockaddr_in *)&rt.rt_gateway;
+		struct sockaddr_in *genmask = (struct sockaddr_in *)&rt.rt_genmask;
+		dst->sin_family = gateway->sin_family = genmask->sin_family = AF_INET;
+		gateway->sin_addr = gw;
+		rt.rt_flags = RTF_UP | RTF_GATEWAY;
+		rt.rt_dev = ncm_ifname;
+		if (udiald_ncm_ioctl(SIOCADDRT, &rt) && errno != EEXIST)
+			syslog(LOG_WARNING, "%s: Failed to add the default route: %s", ncm_ifname, strerror(errno));
+	}
+
+	char buf[INET_ADDRSTRLEN];
+	udiald_config_set(state, "udiald_ncm_ipaddr", inet_ntop(AF_INET, &addr, buf, sizeof(buf)));
+	udiald_config_set(state, "udiald_ncm_netmask", inet_ntop(AF_INET, &mask, buf, sizeof(buf)));
+	udiald_config_set(state, "udiald_ncm_gateway", inet_ntop(AF_INET, &gw, buf, sizeof(buf)));
+	udiald_config_revert(state, "udiald_ncm_dns");
+	for (int i = 4; i < 6; ++i) {
+		struct in_addr dns = udiald_ncm_addr(v[i]);
+		if (dns.s_addr)
+			udiald_config_append(state, "udiald_ncm_dns", inet_ntop(AF_INET, &dns, buf, sizeof(buf)));
+	}
+	syslog(LOG_NOTICE, "%s: Configured address %s", ncm_ifname, inet_ntop(AF_INET, &addr, buf, sizeof(buf)));
+	return UDIALD_OK;
+}
+
+/**
+ * Start a DHCP client on the interface. It runs in the foreground for
+ * the whole session, so it takes the place of pppd: the session ends
+ * when it exits.
+ *
+ * Returns the pid of the client, or 0 when it could not be started.
+ */
+static pid_t udiald_ncm_dhcp(struct udiald_state *state) {
+	char udhcpc[PATH_MAX];
+	snprintf(udhcpc, sizeof(udhcpc), "%s/sbin/udhcpc", state->sysroot);
+	char *const argv[] = {udhcpc, "-f", "-i", ncm_ifname, NULL};
+
+	pid_t pid;
+	int e = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+	if (e) {
+		syslog(LOG_CRIT, "%s: Failed to start %s: %s", ncm_ifname, argv[0], strerror(e));
+		return 0;
+	}
+	return pid;
+}
+
+/**
+ * Wait for the modem to report the connection as up, by its ^NDISSTAT
+ * URC or by polling AT^NDISSTATQRY?, with increasing delays. Modems
+ * that do not know the query only get the URC.
+ *
+ * Returns 0 when connected, -1 when the timeout passed or a terminating
+ * signal arrived.
+ */
+static int udiald_ncm_wait(struct udiald_state *state, int timeout) {
+	uint64_t deadline = udiald_util_monotonic_ms() + timeout;
+	int backoff = 100;
+	bool query = true;
+
+	while (true) {
+		struct udiald_tty_read r = {0};
+		udiald_tty_drain(state->ctlfd);
+		if (query) {
+			udiald_tty_put(state->ctlfd, "AT^NDISSTATQRY?\r");
+			enum udiald_atres res = udiald_tty_get(state->ctlfd, &r, "^NDISSTATQRY:", 2500);
+			if (res == UDIALD_AT_OK && r.result_line)
+				ncm_stat = udiald_ncm_parse_stat(r.result_line);
+			else if (res == UDIALD_AT_ERROR || res == UDIALD_AT_CMEERROR || res == UDIALD_AT_NOT_SUPPORTED)
+				query = false;
+		}
+		if (ncm_stat == 1)
+			return 0;
+
+		uint64_t now = udiald_util_monotonic_ms();
+		if (now >= deadline)
+			return -1;
+		int wait = (deadline - now < (uint64_t)backoff) ? (int)(deadline - now) : backoff;
+		struct pollfd pfd = {.fd = state->ctlfd, .events = POLLIN};
+		if (udiald_tty_interrupted || (poll(&pfd, 1, wait) < 0 && udiald_tty_interrupted))
+			return -1;
+		if (backoff < 1000)
+			backoff *= 2;
+	}
+}
+
+/**
+ * Start a session on the NCM data path: connect with AT^NDISDUP, bring
+ * up the network interface and configure it, using a DHCP client or,
+ * with the udiald_ncm_dhcp option set to 0, the configuration from
+ * AT^DHCP?. The pid of the DHCP client, if any, is put in state->pppd.
+ *
+ * Returns UDIALD_OK, or an error code with a description in *msg.
+ */
+int udiald_ncm_start(struct udiald_state *state, const char **msg) {
+	char b[512];
+	struct udiald_tty_read r = {0};
+
+	state->pppd = 0;
+	if (udiald_ncm_find_netdev(state, ncm_ifname, sizeof(ncm_ifname)) != UDIALD_OK) {
+		*msg = "No NCM network interface found";
+		return UDIALD_ENODEV;
+	}
+
+	char *apn = udiald_config_get(state, "udiald_apn");
+	char *user = udiald_config_get(state, "udiald_user");
+	char *pass = udiald_config_get(state, "udiald_pass");
+	bool invalid = (apn && strpbrk(apn, "\"\r\n;")) || (user && strpbrk(user, "\"\r\n;"))
+		|| (pass && strpbrk(pass, "\"\r\n;"));
+	// Authentication type 2 is CHAP, which also works with networks
+	// that only check the APN
+	if (user && *user)
+		snprintf(b, sizeof(b), "AT^NDISDUP=1,1,\"%s\",\"%s\",\"%s\",2\r", apn ? apn : "", user, pass ? pass : "");
+	else
+		snprintf(b, sizeof(b), "AT^NDISDUP=1,1,\"%s\"\r", apn ? apn : "");
+	free(apn);
+	free(user);
+	free(pass);
+	if (invalid) {
+		*msg = "Invalid character in APN or credentials";
+		return UDIALD_EINVAL;
+	}
+
+	if (udiald_reg_wait(state->ctlfd, state->modem.profile->cfg.maxcmdlen, UDIALD_NCM_NETWORK_TIMEOUT)
+	&& errno != ENOTSUP)
+		syslog(LOG_WARNING, "%s: Not registered to the network, connecting anyway", state->modem.device_id);
+
+	ncm_stat = -1;
+	ncm_lost = false;
+	udiald_tty_urc_subscribe(&ncm_handler);
+
+	syslog(LOG_NOTICE, "%s: Connecting on %s", state->modem.device_id, ncm_ifname);
+	udiald_tty_put(state->ctlfd, b);
+	if (udiald_tty_get(state->ctlfd, &r, NULL, 10000) != UDIALD_AT_OK) {
+		syslog(LOG_ERR, "%s: Failed to connect (%s)", state->modem.device_id,
+			r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
+		udiald_tty_urc_unsubscribe(&ncm_handler);
+		*msg = "Failed to connect";
+		return UDIALD_EDIAL;
+	}
+	if (udiald_ncm_wait(state, UDIALD_NCM_CONNECT_TIMEOUT)) {
+		udiald_tty_put(state->ctlfd, "AT^NDISDUP=1,0\r");
+		udiald_tty_get(state->ctlfd, &r, NULL, 2500);
+		udiald_tty_urc_unsubscribe(&ncm_handler);
+		*msg = "Connection not established";
+		return UDIALD_EDIAL;
+	}
+	syslog(LOG_NOTICE, "%s: Connected", state->modem.device_id);
+	ncm_active = true;
+
+	int code = UDIALD_OK;
+	if (udiald_ncm_set_up(ncm_ifname, true)) {
+		syslog(LOG_ERR, "%s: Failed to bring up the interface: %s", ncm_ifname, strerror(errno));
+		*msg = "Failed to bring up the network interface";
+		code = UDIALD_EINTERNAL;
+	} else if (!udiald_config_get_int(state, "udiald_ncm_dhcp", 1)) {
+		code = udiald_ncm_static(state, msg);
+	} else if (!(state->pppd = udiald_ncm_dhcp(state))) {
+		*msg = "Failed to start the DHCP client";
+		code = UDIALD_EINTERNAL;
+	}
+
+	if (code != UDIALD_OK) {
+		// Don't leave the modem connected
+		const char *ignored;
+		udiald_ncm_stop(state, &ignored);
+		return code;
+	}
+	udiald_config_set(state, "udiald_ifname", ncm_ifname);
+	return UDIALD_OK;
+}
+
+/**
+ * End a session on the NCM data path: stop the DHCP client, disconnect
+ * and take the interface down.
+ *
+ * Returns UDIALD_ENETWORK with a description in *msg when the
+ * connection or DHCP client went away by itself, or UDIALD_ESIGNALED
+ * when it was still up (and *msg is untouched).
+ */
+int udiald_ncm_stop(struct udiald_state *state, const char **msg) {
+	int code = UDIALD_ESIGNALED;
+	struct udiald_tty_read r = {0};
+
+	if (state->pppd) {
+		int status;
+		if (waitpid(state->pppd, &status, WNOHANG) == state->pppd) {
+			*msg = "DHCP client exited";
+			code = UDIALD_ENETWORK;
+		} else {
+			kill(state->pppd, SIGTERM);
+			waitpid(state->pppd, &status, 0);
+		}
+		state->pppd = 0;
+	}
+
+	// Pick up a ^NDISSTAT URC that did not end the status loop yet
+	udiald_tty_drain(state->ctlfd);
+	ncm_active = false;
+	udiald_tty_urc_unsubscribe(&ncm_handler);
+	if (ncm_lost) {
+		*msg = "Terminated by network";
+		code = UDIALD_ENETWORK;
+	}
+
+	udiald_tty_put(state->ctlfd, "AT^NDISDUP=1,0\r");
+	if (udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK)
+		syslog(LOG_WARNING, "%s: Failed to disconnect (%s)", state->modem.device_id,
+			r.lines ? udiald_tty_flatten_result(&r) : strerror(errno));
+
+	if (ncm_ifname[0] && udiald_ncm_set_up(ncm_ifname, false))
+		syslog(LOG_WARNING, "%s: Failed to take down the interface: %s", ncm_ifname, strerror(errno));
+
+	udiald_config_revert(state, "udiald_ifname");
+	udiald_config_revert(state, "udiald_ncm_ipaddr");
+	udiald_config_revert(state, "udiald_ncm_netmask");
+	udiald_config_revert(state, "udiald_ncm_gateway");
+	udiald_config_revert(state, "udiald_ncm_dns");
+	return code;
+}
@@ -0,0 +1,215 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Network registration helpers (+CREG, +CGREG and +CEREG from 27.007).
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "udiald.h"
+
+// First and maximum delay between registration queries, in ms
+#define UDIALD_REG_BACKOFF_MIN 100
+#define UDIALD_REG_BACKOFF_MAX 1000
+// Timeout for a round of registration queries, in ms, but never
+// (much) longer than the time left
+#define UDIALD_REG_QUERY_TIMEOUT 2500
+
+/**
+ * Parse the registration status from a +CREG, +CGREG or +CEREG line.
+ *
+ * Replies to a query have the reporting mode as the first parameter
+ * ("+CREG: <n>,<stat>[,...]"), URCs start with the status itself
+ * ("+CREG: <stat>[,...]"), so the caller has to say which one it is.
+ *
+ * Returns the status, or -1 when the line cannot be parsed.
+ */
+int udiald_reg_parse(const char *line, bool urc) {
+	const char *p = strchr(line, ':');
+	if (!p)
+		return -1;
+	p++;
+
+	if (!urc) {
+		p = strchr(p, ',');
+		if (!p)
+			return -1;
+		p++;
+	}
+
+	char *end;
+	long stat = strtol(p, &end, 10);
+	if (end == p || stat < 0 || stat > UDIALD_REG_MAX)
+		return -1;
+	return stat;
+}
+
+/**
+ * Is the given registration status one in which we can use the
+ * network?
+ */
+bool udiald_reg_attached(int stat) {
+	return stat == UDIALD_REG_HOME || stat == UDIALD_REG_ROAMING;
+}
+
+// Registration seen in URCs while waiting, for the packet domain and
+// circuit switched domain
+static bool urc_ps_attached, urc_cs_attached;
+
+static void udiald_reg_urc(struct udiald_urc_handler *h, const char *line) {
+	int stat = udiald_reg_parse(line, true);
+	if (!udiald_reg_attached(stat))
+		return;
+	if (!strncmp(line, "+CREG:", 6))
+		urc_cs_attached = true;
+	else
+		urc_ps_attached = true;
+}
+
+/**
+ * Wait until the SIM is ready and the modem is registered to the
+ * network, polling +CPIN?, +CGREG?, +CEREG? and +CREG? with increasing
+ * delays.
+ * Anything the modem sends in between (e.g. a registration URC) cuts
+ * the delay short, and registration URCs that arrive in the middle of
+ * a reply are used as well.
+ *
+ * Packet domain registration (+CGREG or, on LTE, +CEREG) is preferred,
+ * circuit switched registration (+CREG) is only used when neither of
+ * those is supported.
+ * Queries the modem does not support are dropped after the first
+ * round.
+ *
+ * Returns 0 when the modem is ready. Returns -1 with errno set to
+ * ETIMEDOUT when it is not ready after timeout ms, to ENOTSUP when
+ * the modem supports none of the registration queries, or to EINTR
+ * when a terminating signal arrived.
+ */
+int udiald_reg_wait(int fd, size_t maxcmdlen, int timeout) {
+	enum {Q_CPIN, Q_CGREG, Q_CEREG, Q_CREG};
+	struct udiald_tty_query queries[] = {
+		[Q_CPIN] = {.cmd = "+CPIN?", .prefix = "+CPIN: "},
+		[Q_CGREG] = {.cmd = "+CGREG?", .prefix = "+CGREG: "},
+		[Q_CEREG] = {.cmd = "+CEREG?", .prefix = "+CEREG: "},
+		[Q_CREG] = {.cmd = "+CREG?", .prefix = "+CREG: "},
+	};
+	bool supported[lengthof(queries)] = {true, true, true, true};
+	struct udiald_urc_handler handlers[] = {
+		{.prefix = "+CREG:", .cb = udiald_reg_urc},
+		{.prefix = "+CGREG:", .cb = udiald_reg_urc},
+		{.prefix = "+CEREG:", .cb = udiald_reg_urc},
+	};
+	uint64_t start = udiald_util_monotonic_ms();
+	uint64_t deadline = start + timeout;
+	int backoff = UDIALD_REG_BACKOFF_MIN;
+	int ret = -1, err = ETIMEDOUT;
+
+	urc_ps_attached = urc_cs_attached = false;
+	for (size_t i = 0; i < lengthof(handlers); ++i)
+		udiald_tty_urc_subscribe(&handlers[i]);
+
+	while (true) {
+		// Query only what the modem supports
+		struct udiald_tty_query q[lengthof(queries)];
+		size_t n = 0;
+		for (size_t i = 0; i < lengthof(queries); ++i) {
+			if (supported[i])
+				q[n++] = queries[i];
+		}
+
+		udiald_tty_drain(fd);
+		if (n) {
+			uint64_t now = udiald_util_monotonic_ms();
+			uint64_t left = deadline > now ? deadline - now : 0;
+			int query_timeout = left < UDIALD_REG_QUERY_TIMEOUT ? (int)left : UDIALD_REG_QUERY_TIMEOUT;
+			if (query_timeout < UDIALD_REG_BACKOFF_MIN)
+				query_timeout = UDIALD_REG_BACKOFF_MIN;
+			udiald_tty_batch(fd, q, n, maxcmdlen, query_timeout);
+		}
+
+		bool sim_ready = false;
+		int cgreg = -1, cereg = -1, creg = -1;
+		for (size_t i = 0, j = 0; i < lengthof(queries); ++i) {
+			if (!supported[i])
+				continue;
+			struct udiald_tty_query *r = &q[j++];
+			// Plain errors and empty replies mean the modem does
+			// not support the query. +CME ERROR is usually
+			// temporary (e.g. SIM busy right after the PIN), so
+			// keep asking.
+			if (r->res == UDIALD_AT_ERROR || r->res == UDIALD_AT_NOT_SUPPORTED
+			|| (r->res == UDIALD_AT_OK && !r->reply[0])) {
+				// The CPIN query should not fail, so don't
+				// stop asking for it
+				if (i != Q_CPIN)
+					supported[i] = false;
+				continue;
+			}
+			if (r->res != UDIALD_AT_OK)
+				continue;
+
+			if (i == Q_CPIN)
+				sim_ready = !strcmp(r->reply, "+CPIN: READY");
+			else if (i == Q_CGREG)
+				cgreg = udiald_reg_parse(r->reply, false);
+			else if (i == Q_CEREG)
+				cereg = udiald_reg_parse(r->reply, false);
+			else if (i == Q_CREG)
+				creg = udiald_reg_parse(r->reply, false);
+		}
+
+		bool attached = urc_ps_attached || udiald_reg_attached(cgreg) || udiald_reg_attached(cereg);
+		if (!supported[Q_CGREG] && !supported[Q_CEREG])
+			attached = attached || urc_cs_attached || udiald_reg_attached(creg);
+		if (sim_ready && attached) {
+			ret = 0;
+			break;
+		}
+		if (!supported[Q_CGREG] && !supported[Q_CEREG] && !supported[Q_CREG]) {
+			err = ENOTSUP;
+			break;
+		}
+
+		uint64_t now = udiald_util_monotonic_ms();
+		if (now >= deadline)
+			break;
+
+		// Wait for the next round, but ask again right away when the
+		// modem sends something, which is usually a registration
+		// URC. The reply to the next query tells for sure.
+		int wait = (deadline - now < (uint64_t)backoff) ? (int)(deadline - now) : backoff;
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		if (udiald_tty_interrupted || (poll(&pfd, 1, wait) < 0 && udiald_tty_interrupted)) {
+			err = EINTR;
+			break;
+		}
+		if (backoff < UDIALD_REG_BACKOFF_MAX)
+			backoff *= 2;
+	}
+
+	for (size_t i = 0; i < lengthof(handlers); ++i)
+		udiald_tty_urc_unsubscribe(&handlers[i]);
+
+	if (ret)
+		errno = err;
+	return ret;
+}
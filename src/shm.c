@@ -0,0 +1,188 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Status file in /var/run, which mirrors the values in the var store
+ * (see var.c) for readers that want the status without going through
+ * uci. See shm.h for the layout.
+ *
+ * The file is updated right away on every change, it does not wait for
+ * the uci state to be saved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "udiald.h"
+#include "shm.h"
+
+static struct udiald_shm_status *shm;
+
+// Start an update, readers retry until udiald_shm_end
+static void udiald_shm_begin(void) {
+	// Force the counter odd, in case an earlier run died halfway
+	uint32_t seq = (shm->seq + 1) | 1;
+	__atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void udiald_shm_end(void) {
+	shm->updated = time(NULL);
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void udiald_shm_copy(char *dst, size_t len, const char *src) {
+	strncpy(dst, src, len - 1);
+	dst[len - 1] = '\0';
+}
+
+// Copy a single value from the var store, without locking
+static void udiald_shm_set(struct udiald_state *state, enum udiald_var_id id) {
+	const struct udiald_var *v = &state->vars[id];
+	const char *val = v->set ? v->value : "";
+
+	switch (id) {
+		case UDIALD_VAR_STATE:
+			udiald_shm_copy(shm->state, sizeof(shm->state), val);
+			break;
+		case UDIALD_VAR_CONNECTED:
+			shm->connected = atoi(val);
+			break;
+		case UDIALD_VAR_PROVIDER:
+			udiald_shm_copy(shm->provider, sizeof(shm->provider), val);
+			break;
+		case UDIALD_VAR_RSSI:
+			shm->rssi = v->set ? atoi(val) : -1;
+			break;
+		case UDIALD_VAR_RAT:
+			udiald_shm_copy(shm->rat, sizeof(shm->rat), val);
+			break;
+		case UDIALD_VAR_REGISTRATION:
+			udiald_shm_copy(shm->registration, sizeof(shm->registration), val);
+			break;
+		case UDIALD_VAR_MODEM_NAME:
+			udiald_shm_copy(shm->modem_name, sizeof(shm->modem_name), val);
+			break;
+		case UDIALD_VAR_MODEM_ID:
+			udiald_shm_copy(shm->modem_id, sizeof(shm->modem_id), val);
+			break;
+		case UDIALD_VAR_SIM_STATE:
+			udiald_shm_copy(shm->sim_state, sizeof(shm->sim_state), val);
+			break;
+		case UDIALD_VAR_ERROR_CODE:
+			shm->error_code = atoi(val);
+			break;
+		case UDIALD_VAR_ERROR_MSG:
+			udiald_shm_copy(shm->error_msg, sizeof(shm->error_msg), val);
+			break;
+		case UDIALD_VAR_RX_BYTES ... UDIALD_VAR_MODEM_TX_BYTES:
+			// These are in the same order as the values
+			(&shm->rx_bytes)[id - UDIALD_VAR_RX_BYTES] = strtoull(val, NULL, 10);
+			break;
+		case UDIALD_VAR_SIGNAL_RSSI ... UDIALD_VAR_SIGNAL_SINR: {
+			// These are in the same order as the values too
+			double db = strtod(val, NULL);
+			(&shm->signal_rssi)[id - UDIALD_VAR_SIGNAL_RSSI] = v->set
+				? (int32_t)(db * 10 + (db < 0 ? -0.5 : 0.5)) : UDIALD_SHM_UNKNOWN;
+			break;
+		}
+		default:
+			// Not in the status file
+			break;
+	}
+}
+
+/**
+ * Create (or reuse) the status file and map it. Failing to do so is not
+ * fatal, udiald just runs without it.
+ */
+void udiald_shm_open(struct udiald_state *state) {
+	char path[256];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s" UDIALD_SHM_PATH, state->sysroot, state->networkname);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Unable to open status file %s: %s", path, strerror(errno));
+		return;
+	}
+
+	// Never shrink the file, readers might have it mapped
+	if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(*shm)
+			&& ftruncate(fd, sizeof(*shm)))) {
+		syslog(LOG_WARNING, "Unable to resize status file %s: %s", path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	void *p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		syslog(LOG_WARNING, "Unable to map status file %s: %s", path, strerror(errno));
+		return;
+	}
+	shm = p;
+
+	// Keep the sequence counter of a previous run, so readers of the
+	// old contents notice the change
+	udiald_shm_begin();
+	size_t off = offsetof(struct udiald_shm_status, updated);
+	memset((char *)shm + off, 0, sizeof(*shm) - off);
+	shm->magic = UDIALD_SHM_MAGIC;
+	shm->version = UDIALD_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	shm->pid = getpid();
+	for (int i = 0; i < UDIALD_NUM_VARS; ++i)
+		udiald_shm_set(state, i);
+	udiald_shm_end();
+}
+
+/**
+ * Publish a changed value in the status file, if it is open.
+ */
+void udiald_shm_update(struct udiald_state *state, enum udiald_var_id id) {
+	if (!shm)
+		return;
+	udiald_shm_begin();
+	udiald_shm_set(state, id);
+	udiald_shm_end();
+}
+
+/**
+ * Mark udiald as no longer running in the status file. The file stays,
+ * so the last state (e.g. the error) can still be read.
+ */
+void udiald_shm_close(void) {
+	if (!shm)
+		return;
+	udiald_shm_begin();
+	shm->pid = 0;
+	shm->connected = 0;
+	udiald_shm_end();
+	munmap(shm, sizeof(*shm));
+	shm = NULL;
+}
@@ -0,0 +1,113 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef UDIALD_SHM_H_
+#define UDIALD_SHM_H_
+
+/*
+ * Layout of the status file udiald keeps in /var/run while connecting,
+ * for readers that map it (see tools/udiald-status.c). This header is
+ * shared with those readers, so it only depends on libc.
+ *
+ * The file holds a single struct udiald_shm_status, which udiald
+ * updates in place. Updates are guarded by a sequence counter (a
+ * seqlock): it is odd while an update is in progress, and incremented
+ * again when done. See udiald_shm_read for how to get a consistent
+ * copy.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// Status file, with the uci network section name
+#define UDIALD_SHM_PATH "/var/run/udiald-%s.status"
+
+#define UDIALD_SHM_MAGIC 0x53444455 /* "UDDS" in little endian */
+// Bump when changing the layout. Fields can be added at the end
+// without a bump, readers use size to tell whether they are there.
+#define UDIALD_SHM_VERSION 1
+
+// How often udiald_shm_read looks at the sequence counter before giving
+// up. This is some tens of ms of spinning, enough to outlast udiald
+// being preempted during an update.
+#define UDIALD_SHM_READ_TRIES 10000000
+
+#define UDIALD_SHM_UNKNOWN INT32_MIN
+
+struct udiald_shm_status {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; /* sizeof(struct udiald_shm_status) of the writer */
+	uint32_t seq; /* Odd while an update is in progress */
+
+	int64_t updated; /* Time of the last update (seconds since the epoch) */
+	int32_t pid; /* Pid of udiald (0 when not running) */
+	int32_t connected; /* 1 when connected */
+	int32_t rssi; /* Signal strength on the +CSQ scale (0-31, 99 unknown, -1 not known yet) */
+	int32_t error_code; /* Exit code of the last error (0 for none) */
+	char state[16]; /* udiald_state: init, dial, connected, standby, error */
+	char sim_state[16];
+	char provider[64];
+	char rat[16]; /* Access technology: gsm, umts, hspa, lte, ... */
+	char registration[16]; /* home, roaming, searching, ... */
+	char modem_id[16]; /* USB vendor:product */
+	char modem_name[64];
+	char error_msg[128];
+	// Traffic on the interface (see traffic.c), 0 when not connected
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t rx_packets, tx_packets;
+	uint64_t rx_errors, tx_errors;
+	uint64_t rx_dropped, tx_dropped;
+	uint64_t rx_rate, tx_rate; /* Average, in bytes per second */
+	uint64_t modem_rx_bytes, modem_tx_bytes; /* As counted by the modem (Huawei only) */
+	// Signal quality (see signal.c), in tenths of a dBm or dB,
+	// UDIALD_SHM_UNKNOWN when the modem did not report it
+	int32_t signal_rssi, signal_rscp, signal_ecio;
+	int32_t signal_rsrp, signal_rsrq, signal_sinr;
+};
+
+/**
+ * Copy the status from a mapped status file into out, retrying while
+ * an update is in progress, up to UDIALD_SHM_READ_TRIES times. This
+ * does no syscalls.
+ *
+ * Returns 0, or -1 with errno set to EINVAL when the file has the wrong
+ * magic or version, or to EAGAIN when no consistent copy could be made
+ * (e.g. because udiald died during an update).
+ */
+static inline int udiald_shm_read(const volatile struct udiald_shm_status *shm, struct udiald_shm_status *out) {
+	if (shm->magic != UDIALD_SHM_MAGIC || shm->version != UDIALD_SHM_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (unsigned long tries = 0; tries < UDIALD_SHM_READ_TRIES; ++tries) {
+		uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(out, (const void *)shm, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+#endif /* UDIALD_SHM_H_ */
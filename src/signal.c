@@ -0,0 +1,362 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Detailed signal quality while connected: RSSI, RSCP and Ec/Io (GSM
+ * and WCDMA) and RSRP, RSRQ and SINR (LTE), in dBm and dB.
+ *
+ * The +CSQ rssi (see status.c) says little on LTE, so these are
+ * queried as well, every UDIALD_SIGNAL_INTERVAL. Which commands are
+ * used depends on the profile (the signal field of its config), see
+ * queries below. Every query returns a part of the values (or all of
+ * them) on its own scale. The results of all queries of a round are
+ * combined, the first query to report a value wins. Values that no
+ * query reported are removed.
+ *
+ * Commands the modem does not know are not used again during the
+ * session.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+
+// Interval between query rounds, in ms
+#define UDIALD_SIGNAL_INTERVAL 15000
+// Number of queries, see enum udiald_signal_query
+#define UDIALD_SIGNAL_QUERIES 5
+
+// The values, in the order of their vars
+enum udiald_signal_value {
+	UDIALD_SIGNAL_RSSI,
+	UDIALD_SIGNAL_RSCP,
+	UDIALD_SIGNAL_ECIO,
+	UDIALD_SIGNAL_RSRP,
+	UDIALD_SIGNAL_RSRQ,
+	UDIALD_SIGNAL_SINR,
+	UDIALD_SIGNAL_VALUES,
+};
+
+// Values in tenths of a dBm or dB
+struct udiald_signal {
+	bool known[UDIALD_SIGNAL_VALUES];
+	int val[UDIALD_SIGNAL_VALUES];
+};
+
+struct udiald_signal_cmd {
+	const char *cmd;
+	const char *result_prefix;
+	void (*parse)(struct udiald_tty_read *r, struct udiald_signal *sig);
+};
+
+struct udiald_signal_status {
+	struct udiald_state *state;
+	struct udiald_at_channel *ch;
+	struct uloop_timeout timer;
+	// The queries of the profile that the modem knows
+	unsigned int queries;
+	// Commands for the current round, and how many have no reply yet
+	struct udiald_at_cmd cmd[UDIALD_SIGNAL_QUERIES];
+	int pending;
+	bool hcsq_urc;
+	struct udiald_signal round;
+};
+
+static struct udiald_signal_status signal_status;
+
+static void udiald_signal_set(struct udiald_signal *sig, enum udiald_signal_value v, int tenths) {
+	if (sig->known[v])
+		return;
+	sig->known[v] = true;
+	sig->val[v] = tenths;
+}
+
+/*
+ * Set a value from a parameter on a scale of steps, where step 0 is
+ * base (in tenths) and every step adds step tenths. Parameters above
+ * max (e.g. 99 or 255) mean the value is unknown.
+ */
+static void udiald_signal_set_scaled(struct udiald_signal *sig, enum udiald_signal_value v,
+		long param, int max, int base, int step) {
+	if (param >= 0 && param <= max)
+		udiald_signal_set(sig, v, base + param * step);
+}
+
+/**
+ * Return the n-th (from 0) comma separated parameter of a reply line
+ * as a number, or -1 when it is missing or empty.
+ */
+static long udiald_signal_param(const char *line, int n) {
+	const char *p = line ? strchr(line, ':') : NULL;
+	if (!p)
+		return -1;
+	p++;
+	for (int i = 0; i < n; ++i) {
+		if (!(p = strchr(p, ',')))
+			return -1;
+		p++;
+	}
+	p += strspn(p, " ");
+	char *end;
+	long v = strtol(p, &end, 10);
+	return (end == p) ? -1 : v;
+}
+
+/* "+CESQ: <rxlev>,<ber>,<rscp>,<ecno>,<rsrq>,<rsrp>" (27.007), where
+ * rxlev 0 is -110 dBm or less, rscp 0 is -120 dBm or less, ecno 0 is
+ * -24 dB or less, rsrq 0 is -19.5 dB or less and rsrp 0 is -140 dBm or
+ * less, all in steps of 1 dBm or 0.5 dB. */
+static void udiald_signal_parse_cesq(struct udiald_tty_read *r, struct udiald_signal *sig) {
+	const char *l = r->result_line;
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSSI, udiald_signal_param(l, 0), 63, -1110, 10);
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSCP, udiald_signal_param(l, 2), 96, -1210, 10);
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_ECIO, udiald_signal_param(l, 3), 49, -245, 5);
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSRQ, udiald_signal_param(l, 4), 34, -200, 5);
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSRP, udiald_signal_param(l, 5), 97, -1410, 10);
+}
+
+/**
+ * Parse a Huawei ^HCSQ reply or URC: "^HCSQ:"<sysmode>",<values>",
+ * with these values for each sysmode:
+ *
+ *   GSM: rssi
+ *   WCDMA, TD-SCDMA: rssi, rscp, ecio
+ *   LTE: rssi, rsrp, sinr, rsrq
+ *
+ * rssi 0 is -120 dBm or less, rscp 0 -120 dBm or less, ecio 0 -32 dB
+ * or less, rsrp 0 -140 dBm or less, sinr 0 -20 dB or less and rsrq 0
+ * -19.5 dB or less, in steps of 1 dBm, 0.5 dB (ecio, rsrq) or 0.2 dB
+ * (sinr). 255 is unknown.
+ */
+static void udiald_signal_parse_hcsq_line(const char *line, struct udiald_signal *sig) {
+	const char *mode = line ? strchr(line, ':') : NULL;
+	if (!mode)
+		return;
+	mode += 1 + strspn(mode + 1, " ");
+
+	udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSSI, udiald_signal_param(line, 1), 96, -1210, 10);
+	if (!strncmp(mode, "\"WCDMA\"", 7) || !strncmp(mode, "\"TD-SCDMA\"", 10)) {
+		udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSCP, udiald_signal_param(line, 2), 96, -1210, 10);
+		udiald_signal_set_scaled(sig, UDIALD_SIGNAL_ECIO, udiald_signal_param(line, 3), 65, -325, 5);
+	} else if (!strncmp(mode, "\"LTE\"", 5)) {
+		udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSRP, udiald_signal_param(line, 2), 97, -1410, 10);
+		udiald_signal_set_scaled(sig, UDIALD_SIGNAL_SINR, udiald_signal_param(line, 3), 251, -202, 2);
+		udiald_signal_set_scaled(sig, UDIALD_SIGNAL_RSRQ, udiald_signal_param(line, 4), 34, -200, 5);
+	}
+}
+
+static void udiald_signal_parse_hcsq(struct udiald_tty_read *r, struct udiald_signal *sig) {
+	udiald_signal_parse_hcsq_line(r->result_line, sig);
+}
+
+/* Huawei "^CSNR: <rscp>,<ecio>", in dBm and dB (WCDMA only) */
+static void udiald_signal_parse_csnr(struct udiald_tty_read *r, struct udiald_signal *sig) {
+	long rscp = udiald_signal_param(r->result_line, 0);
+	long ecio = udiald_signal_param(r->result_line, 1);
+	// Positive values mean there is no WCDMA signal
+	if (rscp < 0 && ecio <= 0 && ecio != -1) {
+		udiald_signal_set(sig, UDIALD_SIGNAL_RSCP, rscp * 10);
+		udiald_signal_set(sig, UDIALD_SIGNAL_ECIO, ecio * 10);
+	}
+}
+
+/* ZTE "+ZRSSI: <rssi>,<ecio>,<rscp>", where rssi is in -dBm, and ecio
+ * and rscp are in -0.5 dB(m) (1000 when not on WCDMA) */
+static void udiald_signal_parse_zrssi(struct udiald_tty_read *r, struct udiald_signal *sig) {
+	long rssi = udiald_signal_param(r->result_line, 0);
+	long ecio = udiald_signal_param(r->result_line, 1);
+	long rscp = udiald_signal_param(r->result_line, 2);
+	if (rssi > 0 && rssi < 200)
+		udiald_signal_set(sig, UDIALD_SIGNAL_RSSI, -rssi * 10);
+	if (ecio >= 0 && ecio < 1000)
+		udiald_signal_set(sig, UDIALD_SIGNAL_ECIO, -ecio * 5);
+	if (rscp >= 0 && rscp < 1000)
+		udiald_signal_set(sig, UDIALD_SIGNAL_RSCP, -rscp * 5);
+}
+
+/* Sierra "!GSTATUS:", followed by lines with one or two "<name>: <value>"
+ * pairs, separated by tabs. The names depend on the access technology
+ * and firmware, the first one that matches is used. */
+static void udiald_signal_parse_gstatus(struct udiald_tty_read *r, struct udiald_signal *sig) {
+	static const struct {
+		const char *name;
+		enum udiald_signal_value v;
+	} keys[] = {
+		{"PCC RxM RSSI:", UDIALD_SIGNAL_RSSI},
+		{"RSSI (dBm):", UDIALD_SIGNAL_RSSI},
+		{"RSCP (dBm):", UDIALD_SIGNAL_RSCP},
+		{"Ec/Io (dB):", UDIALD_SIGNAL_ECIO},
+		{"ECIO (dB):", UDIALD_SIGNAL_ECIO},
+		{"RSRP (dBm):", UDIALD_SIGNAL_RSRP},
+		{"RSRQ (dB):", UDIALD_SIGNAL_RSRQ},
+		{"SINR (dB):", UDIALD_SIGNAL_SINR},
+	};
+	for (size_t i = 0; i < r->lines; ++i) {
+		for (size_t k = 0; k < lengthof(keys); ++k) {
+			const char *p = strstr(r->line[i].s, keys[k].name);
+			if (!p)
+				continue;
+			p += strlen(keys[k].name);
+			char *end;
+			double v = strtod(p, &end);
+			// Except for SINR, 0 and positive values are used
+			// for "no signal"
+			if (end != p && (v < 0 || keys[k].v == UDIALD_SIGNAL_SINR))
+				udiald_signal_set(sig, keys[k].v, (int)(v * 10 + (v < 0 ? -0.5 : 0.5)));
+		}
+	}
+}
+
+// Queries, in the order of the bits of enum udiald_signal_query
+static const struct udiald_signal_cmd queries[UDIALD_SIGNAL_QUERIES] = {
+	{"AT+CESQ\r", "+CESQ:", udiald_signal_parse_cesq},
+	{"AT^HCSQ?\r", "^HCSQ:", udiald_signal_parse_hcsq},
+	{"AT^CSNR?\r", "^CSNR:", udiald_signal_parse_csnr},
+	{"AT+ZRSSI\r", "+ZRSSI:", udiald_signal_parse_zrssi},
+	{"AT!GSTATUS?\r", "!GSTATUS:", udiald_signal_parse_gstatus},
+};
+
+/**
+ * The queries to use for a modem: those of its profile, or those that
+ * suit its vendor when the profile does not say.
+ */
+static unsigned int udiald_signal_queries(const struct udiald_modem *modem) {
+	if (modem->profile && modem->profile->cfg.signal)
+		return modem->profile->cfg.signal;
+	switch (modem->vendor) {
+		case 0x12d1:
+			return UDIALD_SIGNAL_CESQ | UDIALD_SIGNAL_HCSQ | UDIALD_SIGNAL_CSNR;
+		case 0x19d2:
+			return UDIALD_SIGNAL_CESQ | UDIALD_SIGNAL_ZRSSI;
+		case 0x1199:
+			return UDIALD_SIGNAL_CESQ | UDIALD_SIGNAL_GSTATUS;
+		default:
+			return UDIALD_SIGNAL_CESQ;
+	}
+}
+
+static void udiald_signal_fmt(char *buf, size_t len, int tenths) {
+	if (tenths % 10)
+		snprintf(buf, len, "%s%d.%d", tenths < 0 ? "-" : "", abs(tenths) / 10, abs(tenths) % 10);
+	else
+		snprintf(buf, len, "%d", tenths / 10);
+}
+
+/**
+ * Publish a complete set of values. Values that are not known are
+ * removed, since they are probably for another access technology.
+ */
+static void udiald_signal_publish(struct udiald_state *state, const struct udiald_signal *sig) {
+	char buf[16];
+	for (int v = 0; v < UDIALD_SIGNAL_VALUES; ++v) {
+		if (sig->known[v]) {
+			udiald_signal_fmt(buf, sizeof(buf), sig->val[v]);
+			udiald_var_set(state, UDIALD_VAR_SIGNAL_RSSI + v, buf);
+		} else {
+			udiald_var_unset(state, UDIALD_VAR_SIGNAL_RSSI + v);
+		}
+	}
+	udiald_var_flush_soon(state);
+}
+
+/* A ^HCSQ URC has everything a ^HCSQ query would return, for the
+ * access technology in use right now */
+static void udiald_signal_hcsq_urc(struct udiald_urc_handler *h, const char *line) {
+	struct udiald_signal sig = {{0}};
+	udiald_signal_parse_hcsq_line(line, &sig);
+	udiald_signal_publish(signal_status.state, &sig);
+}
+
+static void udiald_signal_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	struct udiald_signal_status *s = &signal_status;
+	int q = c - s->cmd;
+
+	s->pending--;
+	if (res == UDIALD_FAIL && errno == ECANCELED)
+		return;
+
+	if (res == UDIALD_AT_OK) {
+		queries[q].parse(r, &s->round);
+	} else if (res == UDIALD_AT_ERROR || res == UDIALD_AT_CMEERROR) {
+		syslog(LOG_INFO, "%s: Modem does not support %.*s", s->state->modem.device_id,
+			(int)strcspn(c->cmd, "\r"), c->cmd);
+		s->queries &= ~(1 << q);
+	}
+
+	if (s->pending)
+		return;
+	udiald_signal_publish(s->state, &s->round);
+	if (s->queries)
+		uloop_timeout_set(&s->timer, UDIALD_SIGNAL_INTERVAL);
+}
+
+static void udiald_signal_timer(struct uloop_timeout *t) {
+	struct udiald_signal_status *s = &signal_status;
+	memset(&s->round, 0, sizeof(s->round));
+	for (size_t i = 0; i < lengthof(queries); ++i) {
+		if (s->queries & (1 << i))
+			s->pending++;
+	}
+	for (size_t i = 0; i < lengthof(queries); ++i) {
+		if (!(s->queries & (1 << i)))
+			continue;
+		s->cmd[i].cmd = queries[i].cmd;
+		s->cmd[i].result_prefix = queries[i].result_prefix;
+		s->cmd[i].timeout = 2500;
+		s->cmd[i].cb = udiald_signal_reply;
+		udiald_at_submit(s->ch, &s->cmd[i]);
+	}
+}
+
+static struct udiald_urc_handler hcsq_handler = {
+	.prefix = "^HCSQ:", .cb = udiald_signal_hcsq_urc,
+};
+
+/**
+ * Start querying the signal quality on the given AT channel, until
+ * udiald_signal_stop is called.
+ */
+void udiald_signal_start(struct udiald_state *state, struct udiald_at_channel *ch) {
+	memset(&signal_status, 0, sizeof(signal_status));
+	signal_status.state = state;
+	signal_status.ch = ch;
+	signal_status.timer.cb = udiald_signal_timer;
+	signal_status.queries = udiald_signal_queries(&state->modem);
+	if (signal_status.queries & UDIALD_SIGNAL_HCSQ) {
+		udiald_tty_urc_subscribe(&hcsq_handler);
+		signal_status.hcsq_urc = true;
+	}
+	if (signal_status.queries)
+		uloop_timeout_set(&signal_status.timer, 0);
+}
+
+/**
+ * Stop querying the signal quality. Should be called before the AT
+ * channel is closed.
+ */
+void udiald_signal_stop(void) {
+	uloop_timeout_cancel(&signal_status.timer);
+	if (signal_status.hcsq_urc)
+		udiald_tty_urc_unsubscribe(&hcsq_handler);
+	signal_status.hcsq_urc = false;
+}
@@ -0,0 +1,360 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Link status (provider, signal strength, access technology and
+ * registration) while connected.
+ *
+ * The modem is asked to report changes by itself (+CREG/+CGREG/+CEREG
+ * with location info, +CIEV indicator events and the Huawei ^RSSI,
+ * ^MODE and ^HCSQ reports), and the status is updated from those
+ * URCs. Notifications that don't carry the new value themselves (e.g.
+ * a registration change, which may mean a new provider) trigger an
+ * AT+COPS?;+CSQ query shortly after. That query is also done
+ * periodically, but only rarely when the modem reports changes in
+ * signal strength by itself.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+
+// Interval between status queries, in ms, when the modem does not
+// report signal strength changes by itself and when it does
+#define UDIALD_STATUS_INTERVAL 15000
+#define UDIALD_STATUS_FALLBACK_INTERVAL 120000
+// Delay before a query triggered by a URC, in ms, so a burst of URCs
+// (e.g. +CREG and +CGREG after a cell change) causes a single query
+#define UDIALD_STATUS_SETTLE 200
+
+struct udiald_status {
+	struct udiald_state *state;
+	struct udiald_at_channel *ch;
+	struct uloop_timeout timer;
+	// AT+COPS?;+CSQ
+	struct udiald_at_cmd query;
+	// The query was submitted and has no reply yet
+	bool busy;
+	// Something changed while the query was busy, query again
+	bool dirty;
+	// AT+CMER was accepted, so the modem sends +CIEV URCs
+	bool cmer;
+	// A +CGREG or +CEREG URC was seen, ignore the status in +CREG
+	bool ps_urc;
+	// The modem sends its signal strength by itself (^RSSI, ^HCSQ)
+	bool rssi_urc;
+	// Indices of the +CIEV indicators we use (0 when unknown)
+	int ind_signal, ind_service, ind_roam;
+};
+
+static struct udiald_status status;
+
+// Access technology names for the <AcT> values of 27.007 (+COPS,
+// +CREG and friends)
+static const char *actstr[] = {
+	"gsm", "gsm", "umts", "edge", "hsdpa", "hsupa", "hspa", "lte",
+	"ec-gsm-iot", "nb-iot", "lte", "nr", "nr", "en-dc",
+};
+
+// Names for the <stat> values of +CREG and friends
+static const char *regstr[] = {
+	[UDIALD_REG_NONE] = "none",
+	[UDIALD_REG_HOME] = "home",
+	[UDIALD_REG_SEARCHING] = "searching",
+	[UDIALD_REG_DENIED] = "denied",
+	[UDIALD_REG_UNKNOWN] = "unknown",
+	[UDIALD_REG_ROAMING] = "roaming",
+};
+
+/**
+ * Return the n-th (from 0) comma separated parameter of a URC or reply
+ * as a number, or -1 when it is missing or empty. Quoted parameters
+ * (e.g. "1A2B") are read as hex.
+ */
+static long udiald_status_param(const char *line, int n) {
+	const char *p = strchr(line, ':');
+	if (!p)
+		return -1;
+	p++;
+	for (int i = 0; i < n; ++i) {
+		if (!(p = strchr(p, ',')))
+			return -1;
+		p++;
+	}
+	p += strspn(p, " ");
+	int base = 10;
+	if (*p == '"') {
+		p++;
+		base = 16;
+	}
+	char *end;
+	long v = strtol(p, &end, base);
+	return (end == p) ? -1 : v;
+}
+
+static void udiald_status_set_rat(const char *rat) {
+	if (udiald_var_set(status.state, UDIALD_VAR_RAT, rat))
+		syslog(LOG_NOTICE, "%s: Access technology is %s", status.state->modem.device_id, rat);
+}
+
+static void udiald_status_set_rssi(int rssi) {
+	if (udiald_var_set_int(status.state, UDIALD_VAR_RSSI, rssi))
+		syslog(LOG_DEBUG, "%s: RSSI is %d", status.state->modem.device_id, rssi);
+}
+
+static void udiald_status_save(void) {
+	udiald_var_flush_soon(status.state);
+}
+
+/**
+ * Query provider and signal strength soon, for notifications that say
+ * something changed without saying what.
+ */
+static void udiald_status_trigger(void) {
+	if (status.busy)
+		status.dirty = true;
+	else if (!status.timer.pending || uloop_timeout_remaining(&status.timer) > UDIALD_STATUS_SETTLE)
+		uloop_timeout_set(&status.timer, UDIALD_STATUS_SETTLE);
+}
+
+static void udiald_status_query_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	struct udiald_state *state = status.state;
+	status.busy = false;
+
+	if (res == UDIALD_AT_OK && r->lines >= 3) {
+		char *saveptr;
+		char *cops = r->line[0].s;
+		char *csq = r->line[1].s;
+
+		// +COPS: 0,0,"FONIC",2
+		long act = udiald_status_param(cops, 3);
+		if (act >= 0 && act < (long)lengthof(actstr))
+			udiald_status_set_rat(actstr[act]);
+
+		if (cops && (cops = strchr(cops, '"'))
+		&& (cops = strtok_r(cops, "\"", &saveptr))
+		&& udiald_var_set(state, UDIALD_VAR_PROVIDER, cops))
+			syslog(LOG_NOTICE, "%s: Provider is %s", state->modem.device_id, cops);
+
+		if (csq && (csq = strtok_r(csq, " ,", &saveptr))
+		&& (csq = strtok_r(NULL, " ,", &saveptr))) {	// +CSQ: 14,99
+			udiald_status_set_rssi(atoi(csq));
+			if ((csq = strtok_r(NULL, " ,", &saveptr)))
+				udiald_var_set_int(state, UDIALD_VAR_BER, atoi(csq));
+		}
+		udiald_status_save();
+	}
+
+	if (res == UDIALD_FAIL && errno == ECANCELED)
+		return;
+	if (status.dirty) {
+		status.dirty = false;
+		uloop_timeout_set(&status.timer, UDIALD_STATUS_SETTLE);
+	} else {
+		// Registration URCs alone don't say when the signal changes
+		bool push = status.rssi_urc || (status.cmer && status.ind_signal);
+		uloop_timeout_set(&status.timer, push ? UDIALD_STATUS_FALLBACK_INTERVAL : UDIALD_STATUS_INTERVAL);
+	}
+}
+
+static void udiald_status_timer(struct uloop_timeout *t) {
+	if (status.busy)
+		return;
+	status.busy = true;
+	udiald_at_submit(status.ch, &status.query);
+}
+
+/* +CREG, +CGREG and +CEREG URCs, with location info enabled:
+ * "+CGREG: <stat>[,<lac>,<ci>[,<AcT>]]" */
+static void udiald_status_reg_urc(struct udiald_urc_handler *h, const char *line) {
+	bool ps = strncmp(line, "+CREG:", 6);
+	int stat = udiald_reg_parse(line, true);
+	long act = udiald_status_param(line, 3);
+
+	if (ps)
+		status.ps_urc = true;
+	if (stat >= 0 && stat < (int)lengthof(regstr) && regstr[stat] && (ps || !status.ps_urc)
+	&& udiald_var_set(status.state, UDIALD_VAR_REGISTRATION, regstr[stat]))
+		syslog(LOG_NOTICE, "%s: Registration is %s", status.state->modem.device_id, regstr[stat]);
+	if (act >= 0 && act < (long)lengthof(actstr))
+		udiald_status_set_rat(actstr[act]);
+	udiald_status_save();
+
+	// Might be a different cell or network, so check the provider
+	udiald_status_trigger();
+}
+
+/* "+CIEV: <ind>,<value>", see udiald_status_cind_reply */
+static void udiald_status_ciev_urc(struct udiald_urc_handler *h, const char *line) {
+	long ind = udiald_status_param(line, 0);
+	if (ind <= 0)
+		return;
+	// The signal indicator only has a few steps, so get the real
+	// value, unless the modem sends that as well
+	if ((ind == status.ind_signal && !status.rssi_urc)
+	|| ind == status.ind_service || ind == status.ind_roam)
+		udiald_status_trigger();
+}
+
+/* Huawei "^RSSI:<rssi>", on the same scale as +CSQ */
+static void udiald_status_rssi_urc(struct udiald_urc_handler *h, const char *line) {
+	long rssi = udiald_status_param(line, 0);
+	status.rssi_urc = true;
+	if (rssi >= 0) {
+		udiald_status_set_rssi(rssi);
+		udiald_status_save();
+	}
+}
+
+/* Huawei "^MODE:<sys_mode>,<sys_submode>" */
+static void udiald_status_mode_urc(struct udiald_urc_handler *h, const char *line) {
+	const char *rat;
+	switch (udiald_status_param(line, 0)) {
+		case 0: rat = "none"; break;
+		case 2: rat = "cdma"; break;
+		case 3: rat = "gsm"; break;
+		case 4: rat = "evdo"; break;
+		case 5: rat = "umts"; break;
+		case 7: rat = "lte"; break;
+		case 15: rat = "tdscdma"; break;
+		default: return;
+	}
+	udiald_status_set_rat(rat);
+	udiald_status_save();
+}
+
+/* Huawei "^HCSQ:"<sysmode>",<rssi>,...", where rssi is 0 for -120 dBm
+ * or less, up to 96 for -25 dBm or more (255 is unknown) */
+static void udiald_status_hcsq_urc(struct udiald_urc_handler *h, const char *line) {
+	static const struct {const char *name, *rat;} modes[] = {
+		{"\"NOSERVICE\"", "none"}, {"\"GSM\"", "gsm"}, {"\"WCDMA\"", "umts"},
+		{"\"TD-SCDMA\"", "tdscdma"}, {"\"LTE\"", "lte"}, {"\"CDMA\"", "cdma"},
+	};
+	const char *mode = strchr(line, ':') + 1;
+	mode += strspn(mode, " ");
+	for (size_t i = 0; i < lengthof(modes); ++i) {
+		if (!strncmp(mode, modes[i].name, strlen(modes[i].name)))
+			udiald_status_set_rat(modes[i].rat);
+	}
+
+	long v = udiald_status_param(line, 1);
+	if (v >= 0 && v <= 96) {
+		status.rssi_urc = true;
+		// Convert to the +CSQ scale (-113 dBm + 2 dBm per step)
+		int dbm = -121 + v;
+		int csq = (dbm + 113) / 2;
+		udiald_status_set_rssi(csq < 0 ? 0 : (csq > 31 ? 31 : csq));
+	}
+	udiald_status_save();
+}
+
+static struct udiald_urc_handler urc_handlers[] = {
+	{.prefix = "+CREG:", .cb = udiald_status_reg_urc},
+	{.prefix = "+CGREG:", .cb = udiald_status_reg_urc},
+	{.prefix = "+CEREG:", .cb = udiald_status_reg_urc},
+	{.prefix = "+CIEV:", .cb = udiald_status_ciev_urc},
+	{.prefix = "^RSSI:", .cb = udiald_status_rssi_urc},
+	{.prefix = "^MODE:", .cb = udiald_status_mode_urc},
+	{.prefix = "^HCSQ:", .cb = udiald_status_hcsq_urc},
+};
+
+/**
+ * Find the indicators we are interested in, in the
+ * +CIND: ("battchg",(0-5)),("signal",(0-5)),("service",(0-1)),...
+ * reply. Indicators are numbered from 1 in +CIEV.
+ */
+static void udiald_status_cind_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	if (res != UDIALD_AT_OK || !r->result_line)
+		return;
+	int ind = 0;
+	for (const char *p = r->result_line; (p = strstr(p, "(\"")); p += 2) {
+		ind++;
+		if (!strncmp(p + 2, "signal\"", 7) || !strncmp(p + 2, "rssi\"", 5))
+			status.ind_signal = ind;
+		else if (!strncmp(p + 2, "service\"", 8))
+			status.ind_service = ind;
+		else if (!strncmp(p + 2, "roam\"", 5))
+			status.ind_roam = ind;
+	}
+}
+
+static void udiald_status_setup_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	if (res != UDIALD_AT_OK && res != UDIALD_FAIL)
+		syslog(LOG_DEBUG, "%s: Modem does not support %.*s", status.state->modem.device_id,
+			(int)strcspn(c->cmd, "\r"), c->cmd);
+}
+
+static void udiald_status_cmer_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	status.cmer = (res == UDIALD_AT_OK);
+	udiald_status_setup_reply(c, res, r);
+}
+
+// Commands that enable the notifications, sent at the start of every
+// session. Failures are fine, the modem just reports less.
+static struct udiald_at_cmd setup_cmds[] = {
+	{.cmd = "AT+CREG=2\r", .timeout = 2500, .cb = udiald_status_setup_reply},
+	{.cmd = "AT+CGREG=2\r", .timeout = 2500, .cb = udiald_status_setup_reply},
+	{.cmd = "AT+CEREG=2\r", .timeout = 2500, .cb = udiald_status_setup_reply},
+	{.cmd = "AT+CIND=?\r", .result_prefix = "+CIND:", .timeout = 2500, .cb = udiald_status_cind_reply},
+	{.cmd = "AT+CMER=3,0,0,1\r", .timeout = 2500, .cb = udiald_status_cmer_reply},
+};
+
+// Huawei modems only send ^RSSI, ^MODE and ^HCSQ when asked to
+static struct udiald_at_cmd huawei_setup_cmd = {
+	.cmd = "AT^CURC=1\r", .timeout = 2500, .cb = udiald_status_setup_reply,
+};
+
+/**
+ * Start keeping track of the link status on the given AT channel,
+ * until udiald_status_stop is called. The provider and signal strength
+ * are queried right away.
+ */
+void udiald_status_start(struct udiald_state *state, struct udiald_at_channel *ch) {
+	memset(&status, 0, sizeof(status));
+	status.state = state;
+	status.ch = ch;
+	status.timer.cb = udiald_status_timer;
+	status.query.cmd = "AT+COPS?;+CSQ\r";
+	status.query.timeout = 2500;
+	status.query.cb = udiald_status_query_reply;
+
+	for (size_t i = 0; i < lengthof(urc_handlers); ++i)
+		udiald_tty_urc_subscribe(&urc_handlers[i]);
+	for (size_t i = 0; i < lengthof(setup_cmds); ++i)
+		udiald_at_submit(ch, &setup_cmds[i]);
+	if (state->modem.vendor == 0x12d1)
+		udiald_at_submit(ch, &huawei_setup_cmd);
+
+	uloop_timeout_set(&status.timer, 0);
+}
+
+/**
+ * Stop keeping track of the link status and save it. Should be called
+ * before the AT channel is closed.
+ */
+void udiald_status_stop(void) {
+	uloop_timeout_cancel(&status.timer);
+	udiald_var_commit(status.state);
+	for (size_t i = 0; i < lengthof(urc_handlers); ++i)
+		udiald_tty_urc_unsubscribe(&urc_handlers[i]);
+}
@@ -0,0 +1,164 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Wire trace "flight recorder".
+ *
+ * Every chunk of bytes written to or read from a tty is recorded in a
+ * fixed size ring in memory, together with a timestamp. Nothing is
+ * logged while recording, so this does not influence timing and can
+ * stay enabled on production systems. The ring is written to a file
+ * when an error occurs, or when SIGUSR1 is received.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "udiald.h"
+
+// Number of entries in the ring
+#define UDIALD_TRACE_ENTRIES 256
+// Bytes of data per entry. Longer chunks are split over multiple
+// entries.
+#define UDIALD_TRACE_CHUNK 120
+
+struct udiald_trace_entry {
+	// CLOCK_MONOTONIC timestamp
+	uint64_t ns;
+	int16_t fd;
+	uint8_t dir;
+	uint8_t len;
+	char data[UDIALD_TRACE_CHUNK];
+};
+
+static struct udiald_trace_entry ring[UDIALD_TRACE_ENTRIES];
+// Total number of entries ever recorded, the next entry goes at
+// ring[head % UDIALD_TRACE_ENTRIES]
+static unsigned int head;
+static char tracefile[128];
+
+/**
+ * Set the file udiald_trace_dump writes to by default.
+ */
+void udiald_trace_set_file(const char *path) {
+	strncpy(tracefile, path, sizeof(tracefile) - 1);
+}
+
+/**
+ * Record bytes that were written to (UDIALD_TRACE_TX) or read from
+ * (UDIALD_TRACE_RX) a tty.
+ */
+void udiald_trace_record(int fd, enum udiald_trace_dir dir, const char *data, size_t len) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	do {
+		struct udiald_trace_entry *e = &ring[head++ % UDIALD_TRACE_ENTRIES];
+		e->ns = ns;
+		e->fd = fd;
+		e->dir = dir;
+		e->len = (len > UDIALD_TRACE_CHUNK) ? UDIALD_TRACE_CHUNK : len;
+		memcpy(e->data, data, e->len);
+		data += e->len;
+		len -= e->len;
+	} while (len);
+}
+
+/**
+ * Format an unsigned number with at least the given number of digits.
+ * Returns the number of characters written.
+ */
+static size_t udiald_trace_fmt_num(char *out, uint64_t n, int digits) {
+	char tmp[24];
+	size_t len = 0;
+	do {
+		tmp[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n || len < (size_t)digits);
+
+	for (size_t i = 0; i < len; ++i)
+		out[i] = tmp[len - 1 - i];
+	return len;
+}
+
+/**
+ * Write the contents of the ring to the given file (or the file set
+ * with udiald_trace_set_file, when path is NULL), oldest entry first.
+ * Each line has a timestamp, the fd, the direction (">" for written,
+ * "<" for read) and the data with control characters escaped.
+ *
+ * This only uses async-signal-safe functions, so it can be called from
+ * a signal handler.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int udiald_trace_dump(const char *path) {
+	static const char hex[] = "0123456789abcdef";
+	if (!path)
+		path = tracefile;
+	if (!path[0])
+		return -1;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	unsigned int end = head;
+	unsigned int i = (end > UDIALD_TRACE_ENTRIES) ? end - UDIALD_TRACE_ENTRIES : 0;
+	for (; i != end; ++i) {
+		const struct udiald_trace_entry *e = &ring[i % UDIALD_TRACE_ENTRIES];
+		char line[64 + 4 * UDIALD_TRACE_CHUNK];
+		size_t len = udiald_trace_fmt_num(line, e->ns / 1000000000, 1);
+		line[len++] = '.';
+		len += udiald_trace_fmt_num(line + len, e->ns % 1000000000, 9);
+		line[len++] = ' ';
+		len += udiald_trace_fmt_num(line + len, e->fd, 1);
+		line[len++] = ' ';
+		line[len++] = (e->dir == UDIALD_TRACE_TX) ? '>' : '<';
+		line[len++] = ' ';
+
+		for (size_t j = 0; j < e->len; ++j) {
+			unsigned char c = e->data[j];
+			if (c == '\r') {
+				line[len++] = '\\';
+				line[len++] = 'r';
+			} else if (c == '\n') {
+				line[len++] = '\\';
+				line[len++] = 'n';
+			} else if (c < 0x20 || c >= 0x7f || c == '\\') {
+				line[len++] = '\\';
+				line[len++] = 'x';
+				line[len++] = hex[c >> 4];
+				line[len++] = hex[c & 0xf];
+			} else {
+				line[len++] = c;
+			}
+		}
+		line[len++] = '\n';
+
+		if (write(fd, line, len) != (ssize_t)len) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
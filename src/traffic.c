@@ -0,0 +1,298 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Traffic counters while connected.
+ *
+ * The counters of the network interface (ppp0 or the NCM interface)
+ * are read from /sys/class/net/<if>/statistics every
+ * UDIALD_TRAFFIC_INTERVAL and published together with the receive and
+ * send rates, which are averaged (an exponentially weighted moving
+ * average) to smooth out bursts.
+ *
+ * Huawei modems also count the bytes of the connection themselves. These
+ * come from the ^DSFLOWRPT reports the modem sends every few seconds
+ * (enabled by AT^CURC=1, see status.c), or from AT^DSFLOWQRY when it
+ * does not send them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+#include "config.h"
+
+// Interval between samples, in ms
+#define UDIALD_TRAFFIC_INTERVAL 5000
+// Time constant of the rate average, in ms. A change in rate shows
+// for about 63% after this time.
+#define UDIALD_TRAFFIC_SMOOTHING 20000
+
+// Files in /sys/class/net/<if>/statistics, in the order of the values
+// they are published as
+static const char *counter_file[] = {
+	"rx_bytes", "tx_bytes", "rx_packets", "tx_packets",
+	"rx_errors", "tx_errors", "rx_dropped", "tx_dropped",
+};
+#define UDIALD_TRAFFIC_COUNTERS lengthof(counter_file)
+
+struct udiald_traffic {
+	struct udiald_state *state;
+	struct udiald_at_channel *ch;
+	struct uloop_timeout timer;
+	char ifname[IFNAMSIZ];
+	// Open statistics files, re-read with pread (-1 when not open)
+	int fd[UDIALD_TRAFFIC_COUNTERS];
+	uint64_t counter[UDIALD_TRAFFIC_COUNTERS];
+	uint64_t sampled; /* Time of the last sample (0 for none) */
+	double rate[2]; /* Receive and send rate, in bytes per second */
+	// AT^DSFLOWQRY
+	struct udiald_at_cmd flowqry;
+	bool flow_busy;
+	// The modem sends ^DSFLOWRPT, so no need to query
+	bool flow_urc;
+	// The modem does not know AT^DSFLOWQRY
+	bool flow_unsupported;
+};
+
+static struct udiald_traffic traffic;
+
+static void udiald_traffic_set(enum udiald_var_id id, uint64_t val) {
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%" PRIu64, val);
+	udiald_var_set(traffic.state, id, buf);
+}
+
+static void udiald_traffic_close(void) {
+	for (size_t i = 0; i < UDIALD_TRAFFIC_COUNTERS; ++i) {
+		if (traffic.fd[i] != -1)
+			close(traffic.fd[i]);
+		traffic.fd[i] = -1;
+	}
+	traffic.ifname[0] = '\0';
+}
+
+/**
+ * Find the name of the interface for this connection. For PPP, this is
+ * the ifname option when given, otherwise pppd puts it on the second
+ * line of its pid file (/var/run/ppp-<linkname>.pid) once the link is
+ * up. Returns false when it is not known (yet).
+ */
+static bool udiald_traffic_find_ifname(struct udiald_state *state, char *ifname, size_t len) {
+	const char *option = (state->modem.profile->cfg.datapath == UDIALD_DATAPATH_NCM)
+		? "udiald_ifname" : "ifname";
+	char *val = udiald_config_get(state, option);
+	if (val && *val) {
+		snprintf(ifname, len, "%s", val);
+		free(val);
+		return true;
+	}
+	free(val);
+	if (state->modem.profile->cfg.datapath == UDIALD_DATAPATH_NCM)
+		return false;
+
+	char path[PATH_MAX], buf[64];
+	snprintf(path, sizeof(path), "%s/var/run/ppp-%s.pid", state->sysroot, state->networkname);
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	bool found = fgets(buf, sizeof(buf), fp) && fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	buf[strcspn(buf, "\n")] = '\0';
+	if (!found || !buf[0])
+		return false;
+	snprintf(ifname, len, "%s", buf);
+	return true;
+}
+
+/**
+ * Open the statistics files of the interface. The files are kept open,
+ * reading them again from the start gives the current value.
+ */
+static bool udiald_traffic_open(void) {
+	struct udiald_state *state = traffic.state;
+	char path[PATH_MAX];
+	if (!udiald_traffic_find_ifname(state, traffic.ifname, sizeof(traffic.ifname)))
+		return false;
+
+	for (size_t i = 0; i < UDIALD_TRAFFIC_COUNTERS; ++i) {
+		snprintf(path, sizeof(path), "%s/sys/class/net/%s/statistics/%s",
+			state->sysroot, traffic.ifname, counter_file[i]);
+		if ((traffic.fd[i] = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+			syslog(LOG_DEBUG, "%s: Failed to open: %s", path, strerror(errno));
+			udiald_traffic_close();
+			return false;
+		}
+	}
+	syslog(LOG_INFO, "%s: Counting traffic on %s", state->modem.device_id, traffic.ifname);
+	return true;
+}
+
+static bool udiald_traffic_read(uint64_t counter[]) {
+	char buf[32];
+	for (size_t i = 0; i < UDIALD_TRAFFIC_COUNTERS; ++i) {
+		ssize_t n = pread(traffic.fd[i], buf, sizeof(buf) - 1, 0);
+		if (n <= 0) {
+			// The interface is gone (or renamed)
+			syslog(LOG_DEBUG, "%s: Failed to read %s: %s", traffic.ifname, counter_file[i],
+				n ? strerror(errno) : "empty");
+			return false;
+		}
+		buf[n] = '\0';
+		counter[i] = strtoull(buf, NULL, 10);
+	}
+	return true;
+}
+
+static void udiald_traffic_sample(void) {
+	uint64_t counter[UDIALD_TRAFFIC_COUNTERS];
+	if (traffic.fd[0] == -1 && !udiald_traffic_open())
+		return;
+	if (!udiald_traffic_read(counter)) {
+		udiald_traffic_close();
+		traffic.sampled = 0;
+		return;
+	}
+
+	uint64_t now = udiald_util_monotonic_ms();
+	for (int dir = 0; dir < 2; ++dir) {
+		// The bytes counters come first
+		double rate = 0;
+		if (traffic.sampled && now > traffic.sampled && counter[dir] >= traffic.counter[dir])
+			rate = (counter[dir] - traffic.counter[dir]) * 1000.0 / (now - traffic.sampled);
+		if (traffic.sampled) {
+			// Weigh by the time since the last sample, so a late
+			// timer does not skew the average
+			double weight = (double)(now - traffic.sampled) / (now - traffic.sampled + UDIALD_TRAFFIC_SMOOTHING);
+			traffic.rate[dir] += weight * (rate - traffic.rate[dir]);
+		}
+	}
+	memcpy(traffic.counter, counter, sizeof(counter));
+	traffic.sampled = now;
+
+	for (size_t i = 0; i < UDIALD_TRAFFIC_COUNTERS; ++i)
+		udiald_traffic_set(UDIALD_VAR_RX_BYTES + i, counter[i]);
+	udiald_traffic_set(UDIALD_VAR_RX_RATE, traffic.rate[0] + 0.5);
+	udiald_traffic_set(UDIALD_VAR_TX_RATE, traffic.rate[1] + 0.5);
+	udiald_var_flush_soon(traffic.state);
+}
+
+/**
+ * Return the n-th (from 0) comma separated hex parameter of a ^DSFLOWRPT
+ * or ^DSFLOWQRY line in *val. Returns false when it is missing.
+ */
+static bool udiald_traffic_hex_param(const char *line, int n, uint64_t *val) {
+	const char *p = strchr(line, ':');
+	if (!p)
+		return false;
+	p++;
+	for (int i = 0; i < n; ++i) {
+		if (!(p = strchr(p, ',')))
+			return false;
+		p++;
+	}
+	char *end;
+	*val = strtoull(p, &end, 16);
+	return end != p;
+}
+
+static void udiald_traffic_set_modem(uint64_t tx, uint64_t rx) {
+	udiald_traffic_set(UDIALD_VAR_MODEM_RX_BYTES, rx);
+	udiald_traffic_set(UDIALD_VAR_MODEM_TX_BYTES, tx);
+	udiald_var_flush_soon(traffic.state);
+}
+
+/* "^DSFLOWRPT:<time>,<tx_rate>,<rx_rate>,<tx_flow>,<rx_flow>,<qos_tx_rate>,<qos_rx_rate>",
+ * all in hex, flows in bytes for the current connection */
+static void udiald_traffic_flowrpt_urc(struct udiald_urc_handler *h, const char *line) {
+	uint64_t tx, rx;
+	traffic.flow_urc = true;
+	if (udiald_traffic_hex_param(line, 3, &tx) && udiald_traffic_hex_param(line, 4, &rx))
+		udiald_traffic_set_modem(tx, rx);
+}
+
+/* "^DSFLOWQRY:<last_time>,<last_tx_flow>,<last_rx_flow>,<total_time>,<total_tx_flow>,<total_rx_flow>",
+ * where last is the current (or last) connection */
+static void udiald_traffic_flowqry_reply(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r) {
+	uint64_t tx, rx;
+	traffic.flow_busy = false;
+	if (res == UDIALD_AT_OK && r->result_line
+	&& udiald_traffic_hex_param(r->result_line, 1, &tx) && udiald_traffic_hex_param(r->result_line, 2, &rx))
+		udiald_traffic_set_modem(tx, rx);
+	else if (res == UDIALD_AT_ERROR || res == UDIALD_AT_CMEERROR)
+		traffic.flow_unsupported = true;
+}
+
+static void udiald_traffic_timer(struct uloop_timeout *t) {
+	udiald_traffic_sample();
+	if (traffic.state->modem.vendor == 0x12d1 && !traffic.flow_urc
+	&& !traffic.flow_unsupported && !traffic.flow_busy) {
+		traffic.flow_busy = true;
+		udiald_at_submit(traffic.ch, &traffic.flowqry);
+	}
+	uloop_timeout_set(&traffic.timer, UDIALD_TRAFFIC_INTERVAL);
+}
+
+static struct udiald_urc_handler flowrpt_handler = {
+	.prefix = "^DSFLOWRPT:", .cb = udiald_traffic_flowrpt_urc,
+};
+
+/**
+ * Start counting traffic, until udiald_traffic_stop is called. The
+ * interface may not exist yet, it is looked for on every sample until
+ * it is found.
+ */
+void udiald_traffic_start(struct udiald_state *state, struct udiald_at_channel *ch) {
+	memset(&traffic, 0, sizeof(traffic));
+	for (size_t i = 0; i < UDIALD_TRAFFIC_COUNTERS; ++i)
+		traffic.fd[i] = -1;
+	traffic.state = state;
+	traffic.ch = ch;
+	traffic.timer.cb = udiald_traffic_timer;
+	traffic.flowqry.cmd = "AT^DSFLOWQRY\r";
+	traffic.flowqry.result_prefix = "^DSFLOWQRY:";
+	traffic.flowqry.timeout = 2500;
+	traffic.flowqry.cb = udiald_traffic_flowqry_reply;
+
+	udiald_tty_urc_subscribe(&flowrpt_handler);
+	uloop_timeout_set(&traffic.timer, 0);
+}
+
+/**
+ * Take a last sample and stop counting traffic. Should be called
+ * before the AT channel is closed.
+ */
+void udiald_traffic_stop(void) {
+	uloop_timeout_cancel(&traffic.timer);
+	udiald_tty_urc_unsubscribe(&flowrpt_handler);
+
+	udiald_traffic_sample();
+	if (traffic.sampled)
+		syslog(LOG_NOTICE, "%s: Received %" PRIu64 " bytes, sent %" PRIu64 " bytes",
+			traffic.ifname, traffic.counter[0], traffic.counter[1]);
+	udiald_traffic_close();
+}
@@ -19,6 +19,8 @@
  *
  */
 
+#define _GNU_SOURCE // Get pipe2 and environ
+
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,23 +31,95 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <poll.h>
+#include <spawn.h>
+#include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include "udiald.h"
 #include "config.h"
 
-static const char *ttyresstr[] = {
-	[UDIALD_AT_OK] = "OK",
-	[UDIALD_AT_CONNECT] = "CONNECT",
-	[UDIALD_AT_ERROR] = "ERROR",
-	[UDIALD_AT_CMEERROR] = "+CME ERROR",
-	[UDIALD_AT_NODIALTONE] = "NO DIALTONE",
-	[UDIALD_AT_BUSY] = "BUSY",
-	[UDIALD_AT_NOCARRIER] = "NO CARRIER",
-	// This one seems to be Huawei-specific:
-	[UDIALD_AT_NOT_SUPPORTED] = "COMMAND NOT SUPPORT",
+// Prefixes of unsolicited result codes (URCs). Modems can send these
+// at any time, so they can end up in the middle of a reply.
+static const char *urcprefix[] = {
+	// Huawei status reports (^RSSI, ^MODE, ^BOOT, ^DSFLOWRPT, ...)
+	"^",
+	"+CREG:",
+	"+CGREG:",
+	"+CEREG:",
+	"+CIEV:",
+	"+CGEV:",
+	"+CRING:",
+	"RING",
+	"+CMTI:",
+	"+CDSI:",
+	"+CUSD:",
+	"+ZUSIMR:",
+	"+ZDONR:",
+};
+
+// Initial size of the per-tty input buffer. This is the most that is
+// read from the tty in a single read() call, unless a reply does not
+// fit and the buffer is grown.
+#define UDIALD_TTY_BUFSIZE 4096
+// The input buffer is never grown beyond this size
+#define UDIALD_TTY_BUFMAX 65536
+// Initial number of line views per tty
+#define UDIALD_TTY_LINES 16
+
+// Fd on which pppd gets its options
+#define UDIALD_PPPD_OPTFD 3
+
+// Maximum number of URCs waiting to be dispatched
+#define UDIALD_URC_QUEUE_MAX 32
+
+/* Input buffer for a single tty fd. Bytes received after the final
+ * result code of a command are kept here for the next command, instead
+ * of being thrown away.
+ *
+ * The buffer also serves as storage for the reply returned by
+ * udiald_tty_get: the lines in the udiald_tty_read point directly into
+ * data, so they remain valid until the next call for the same fd. Both
+ * data and lines are only grown when a reply does not fit, so normally
+ * no allocations are done after the first command. */
+struct udiald_tty_buf {
+	struct list_head h;
+	int fd;
+	// Offset of the first unconsumed byte in data
+	size_t start;
+	// Offset just past the last valid byte in data
+	size_t end;
+	size_t size;
+	char *data;
+	// Storage for the line views of the last reply
+	struct udiald_tty_line *lines;
+	size_t maxlines;
+	// Also recognize numeric (ATV0) result codes
+	bool numeric;
+};
+
+static LIST_HEAD(ttybufs);
+
+/* A queued URC */
+struct udiald_urc {
+	struct list_head h;
+	char line[];
 };
 
+static LIST_HEAD(urcqueue);
+static size_t urcqueued;
+static LIST_HEAD(urchandlers);
+
+// The last command written, used to recognize replies that look like
+// URCs
+static char lastcmd[128];
+// When the last command was written (monotonic ms), or 0 when its
+// reply was already received
+static uint64_t lastput;
+
+// Set by the handlers of signals that should abort waiting for the
+// modem, see udiald_tty_fill
+volatile sig_atomic_t udiald_tty_interrupted;
+
 int udiald_tty_open(const char *tty) {
 	struct termios tio;
 	int fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
@@ -77,7 +151,7 @@ const char *udiald_tty_flatten_result(struct udiald_tty_read *r) {
 	char *end = flat + lengthof(r->flat_buf) - 1;
 
 	for (size_t i = 0; i < r->lines; ++i) {
-		char *in = r->raw_lines[i];
+		const char *in = r->line[i].s;
 		if (flat != end) *flat++ = '"';
 		while (*in)
 			if (flat != end) *flat++ = *in++;
@@ -94,146 +168,626 @@ const char *udiald_tty_flatten_result(struct udiald_tty_read *r) {
 }
 
 int udiald_tty_put(int fd, const char *cmd) {
-	if (verbose >= 2)
-		syslog(LOG_DEBUG, "Writing: %s", cmd);
-	if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
+	if (udiald_tty_put_partial(fd, cmd, 0) != strlen(cmd))
 		return -1;
 	return strlen(cmd);
 }
 
-// Retrieve answer from modem
-enum udiald_atres udiald_tty_get(int fd, struct udiald_tty_read *r, const char *result_prefix, int timeout) {
-	struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLERR | POLLHUP};
+/**
+ * Write the part of cmd starting at offset off, for use on a
+ * non-blocking fd. Pass an offset of 0 for the first write of a
+ * command, and the sum of all earlier return values for the next ones.
+ *
+ * Returns the number of bytes written, which can be less than the
+ * remaining length, or -1 on error (errno is EAGAIN when the fd is
+ * not writable right now).
+ */
+ssize_t udiald_tty_put_partial(int fd, const char *cmd, size_t off) {
+	if (!off) {
+		if (verbose >= 2)
+			syslog(LOG_DEBUG, "Writing: %s", cmd);
+		// Remember the command, so replies to it are not mistaken for
+		// URCs
+		snprintf(lastcmd, sizeof(lastcmd), "%s", cmd);
+		lastput = udiald_util_monotonic_ms();
+	}
+	ssize_t n = write(fd, cmd + off, strlen(cmd) - off);
+	if (n > 0)
+		udiald_trace_record(fd, UDIALD_TRACE_TX, cmd + off, n);
+	return n;
+}
 
-	int err;
-	char *c = r->raw_buf;
-	size_t rem = lengthof(r->raw_buf);
-	r->lines = 0;
-	r->result_line = NULL;
-	bool in_newline = true;
+/**
+ * Find the input buffer for the given fd, allocating a new one if
+ * needed. Returns NULL when allocation fails.
+ */
+static struct udiald_tty_buf *udiald_tty_buf(int fd) {
+	struct udiald_tty_buf *b;
+	list_for_each_entry(b, &ttybufs, h) {
+		if (b->fd == fd)
+			return b;
+	}
 
-	// Modems are evil, they might not send the complete answer when doing
-	// a read, so we read until we get a known AT status code (see top)
-	while (rem > 0) {
-		err = poll(&pfd, 1, timeout);
-		if (err == 0) {
-			syslog(LOG_ERR, "Poll timed out");
-			errno = ETIMEDOUT;
-			return -1;
+	b = calloc(1, sizeof(*b));
+	if (b) {
+		b->data = malloc(UDIALD_TTY_BUFSIZE);
+		b->lines = malloc(UDIALD_TTY_LINES * sizeof(*b->lines));
+	}
+	if (!b || !b->data || !b->lines) {
+		syslog(LOG_CRIT, "Failed to allocate tty buffer: %s", strerror(errno));
+		if (b) {
+			free(b->data);
+			free(b->lines);
 		}
-		if (err < 0) {
-			syslog(LOG_ERR, "Poll failed: %s", strerror(errno));
-			return -1;
+		free(b);
+		return NULL;
+	}
+	b->fd = fd;
+	b->size = UDIALD_TTY_BUFSIZE;
+	b->maxlines = UDIALD_TTY_LINES;
+	list_add(&b->h, &ttybufs);
+	return b;
+}
+
+/**
+ * Throw away the consumed part of the input buffer, moving any
+ * unconsumed bytes to the start. This invalidates the lines of the
+ * previous reply.
+ */
+static void udiald_tty_compact(struct udiald_tty_buf *b) {
+	if (b->start) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+}
+
+/**
+ * Double the size of the input buffer. Any line views in r (which may
+ * be NULL) are updated to point into the new buffer.
+ *
+ * Returns 0 on success, or -1 when the buffer cannot grow any further.
+ */
+static int udiald_tty_grow(struct udiald_tty_buf *b, struct udiald_tty_read *r) {
+	size_t size = b->size * 2;
+	char *data = (size <= UDIALD_TTY_BUFMAX) ? malloc(size) : NULL;
+	if (!data) {
+		syslog(LOG_ERR, "No complete response received within %zu bytes", b->size);
+		errno = ERANGE;
+		return -1;
+	}
+	memcpy(data, b->data, b->end);
+
+	if (r) {
+		for (size_t i = 0; i < r->lines; ++i)
+			r->line[i].s = data + (r->line[i].s - b->data);
+		if (r->result_line)
+			r->result_line = data + (r->result_line - b->data);
+	}
+
+	free(b->data);
+	b->data = data;
+	b->size = size;
+	return 0;
+}
+
+/**
+ * Return the next complete line from the input buffer, or NULL when
+ * the buffer does not contain a complete line. Empty lines are
+ * skipped.
+ *
+ * The line is nul-terminated in place and remains valid until the
+ * buffer is compacted or grown.
+ */
+static char *udiald_tty_next_line(struct udiald_tty_buf *b, size_t *len) {
+	while (b->start < b->end) {
+		char *line = b->data + b->start;
+		size_t n = 0;
+		while (b->start + n < b->end && line[n] != '\r' && line[n] != '\n')
+			++n;
+
+		if (b->start + n == b->end)
+			return NULL; // Incomplete line
+
+		line[n] = '\0';
+		b->start += n + 1;
+		if (n) {
+			*len = n;
+			return line;
 		}
+	}
+	return NULL;
+}
 
-		ssize_t rxed;
-		while ((rxed = read(fd, c, 1)) > 0) {
-			if (c[0] == '\r' || c[0] == '\n') {
-				if (!in_newline) {
-					// Found the end of the current line,
-					// process it.
-					in_newline = true;
-					// Replace the newline with a
-					// nul-termination
-					c[0] = '\0';
-
-					char *start = r->raw_lines[r->lines];
-
-					syslog(LOG_DEBUG, "Read: %s", start);
-
-					if (start[0] == '^') {
-						// Async reply, pretend the line was
-						// never there
-						c = start;
-						continue;
-					}
-
-					++r->lines;
-
-					// See if the current line starts with the
-					// given prefix
-					if (!r->result_line && result_prefix && !strncmp(start, result_prefix, strlen(result_prefix)))
-					    r->result_line = start;
-
-					// Compare with known AT status codes (array at the very top)
-					for (size_t i = 0; i < lengthof(ttyresstr); ++i)
-						if (!strncmp(start, ttyresstr[i], strlen(ttyresstr[i])))
-							return i;
-
-			    } else {
-				    // Continuing the current newline, don't
-				    // include this character in the output.
-				    rxed = 0;
-			    }
-			} else if (in_newline) {
-				// We were in a newline, but now found a
-				// non-newline character. Start a new line.
-
-				if (r->lines == lengthof(r->raw_lines) - 1) {
-					syslog(LOG_ERR, "No complete response received within %zu lines", lengthof(r->raw_lines));
-					errno = ERANGE;
-					return -1;
-				}
-
-				// Remember the start of the line
-				r->raw_lines[r->lines] = c;
-
-				in_newline = false;
-			} else {
-				// Regular character, halfway a line. Do
-				// nothing special.
+/**
+ * Read more input into the buffer, waiting at most timeout ms for it
+ * to arrive. The buffer must have room left, see udiald_tty_grow.
+ *
+ * Returns 0 on success, or -1 on error or timeout (with errno set).
+ * When a terminating signal arrived (udiald_tty_interrupted is set),
+ * this fails with EINTR.
+ */
+static int udiald_tty_fill(struct udiald_tty_buf *b, int timeout) {
+	struct pollfd pfd = {.fd = b->fd, .events = POLLIN | POLLERR | POLLHUP};
+	uint64_t deadline = udiald_util_monotonic_ms() + timeout;
+
+	// Other signals (e.g. SIGUSR1 for a trace dump) interrupt the poll
+	// too, wait for the rest of the timeout after those
+	int err;
+	while ((err = poll(&pfd, 1, timeout)) < 0 && errno == EINTR && !udiald_tty_interrupted) {
+		uint64_t now = udiald_util_monotonic_ms();
+		timeout = (now < deadline) ? (int)(deadline - now) : 0;
+	}
+	if (err == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (err < 0 && errno == EINTR)
+		return -1;
+	if (err < 0) {
+		syslog(LOG_ERR, "Poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	// Read everything that is available in one go
+	ssize_t rxed = read(b->fd, b->data + b->end, b->size - b->end);
+	if (rxed == 0) {
+		syslog(LOG_ERR, "Read failed: end of file");
+		errno = EIO;
+		return -1;
+	}
+	if (rxed == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		syslog(LOG_ERR, "Read failed: %s", strerror(errno));
+		return -1;
+	}
+	udiald_trace_record(b->fd, UDIALD_TRACE_RX, b->data + b->end, rxed);
+	b->end += rxed;
+	return 0;
+}
+
+/**
+ * Does the given line start with the given prefix?
+ */
+static bool udiald_tty_prefixed(const char *line, const char *prefix) {
+	return !strncmp(line, prefix, strlen(prefix));
+}
+
+/**
+ * Does the line consist of the given word, optionally followed by
+ * parameters (separated by a space or colon)?
+ */
+static bool udiald_tty_word(const char *line, size_t len, const char *word, size_t wlen) {
+	return len >= wlen && !memcmp(line, word, wlen)
+		&& (len == wlen || line[wlen] == ' ' || line[wlen] == ':');
+}
+
+#define WORD(w) (w), (sizeof(w) - 1)
+
+/**
+ * Recognize the final result codes from V.250 and 27.007 (and some
+ * vendor-specific ones). Returns the result code, or UDIALD_FAIL when
+ * the line is not a final result code.
+ *
+ * When numeric is true, the single digit result codes used in ATV0
+ * mode are also recognized. Note that this means that a reply line
+ * consisting of just a single digit is also taken as a result code,
+ * so only use this when the modem is actually in ATV0 mode.
+ */
+static enum udiald_atres udiald_tty_result_code(const char *line, size_t len, bool numeric) {
+	switch (line[0]) {
+		case 'O':
+			if (udiald_tty_word(line, len, WORD("OK")))
+				return UDIALD_AT_OK;
+			break;
+		case 'C':
+			// CONNECT can be followed by a data rate
+			if (udiald_tty_word(line, len, WORD("CONNECT")))
+				return UDIALD_AT_CONNECT;
+			// This one seems to be Huawei-specific
+			if (udiald_tty_word(line, len, WORD("COMMAND NOT SUPPORT")))
+				return UDIALD_AT_NOT_SUPPORTED;
+			break;
+		case 'E':
+			if (udiald_tty_word(line, len, WORD("ERROR")))
+				return UDIALD_AT_ERROR;
+			break;
+		case '+':
+			if (udiald_tty_word(line, len, WORD("+CME ERROR")))
+				return UDIALD_AT_CMEERROR;
+			if (udiald_tty_word(line, len, WORD("+CMS ERROR")))
+				return UDIALD_AT_CMSERROR;
+			break;
+		case 'N':
+			if (udiald_tty_word(line, len, WORD("NO CARRIER")))
+				return UDIALD_AT_NOCARRIER;
+			if (udiald_tty_word(line, len, WORD("NO DIALTONE"))
+			|| udiald_tty_word(line, len, WORD("NO DIAL TONE")))
+				return UDIALD_AT_NODIALTONE;
+			if (udiald_tty_word(line, len, WORD("NO ANSWER")))
+				return UDIALD_AT_NOANSWER;
+			break;
+		case 'B':
+			if (udiald_tty_word(line, len, WORD("BUSY")))
+				return UDIALD_AT_BUSY;
+			break;
+		case 'A':
+			if (udiald_tty_word(line, len, WORD("ABORTED")))
+				return UDIALD_AT_ABORTED;
+			break;
+		case '0': case '1': case '3': case '4':
+		case '6': case '7': case '8':
+			if (!numeric || len != 1)
+				break;
+			// Numeric codes from V.250 (2 is RING, 5 is unused)
+			switch (line[0]) {
+				case '0': return UDIALD_AT_OK;
+				case '1': return UDIALD_AT_CONNECT;
+				case '3': return UDIALD_AT_NOCARRIER;
+				case '4': return UDIALD_AT_ERROR;
+				case '6': return UDIALD_AT_NODIALTONE;
+				case '7': return UDIALD_AT_BUSY;
+				case '8': return UDIALD_AT_NOANSWER;
 			}
+			break;
+	}
+	return UDIALD_FAIL;
+}
+
+#undef WORD
 
-			rem -= rxed;
-			c += rxed;
+/**
+ * Enable or disable recognition of numeric (ATV0) result codes on the
+ * given fd. Verbose result codes are always recognized.
+ */
+void udiald_tty_set_numeric(int fd, bool numeric) {
+	struct udiald_tty_buf *b = udiald_tty_buf(fd);
+	if (b)
+		b->numeric = numeric;
+}
+
+/**
+ * Decide if the given line is an unsolicited result code (URC),
+ * instead of a reply to the current command.
+ *
+ * A line that looks like a URC is still considered a reply when it
+ * starts with the result prefix passed by the caller, or when the
+ * command that was last sent contains the same command name (e.g.
+ * "+CREG: 0,1" in reply to "AT+CREG?").
+ */
+static bool udiald_tty_is_urc(const char *line, const char *result_prefix) {
+	if (result_prefix && udiald_tty_prefixed(line, result_prefix))
+		return false;
+
+	for (size_t i = 0; i < lengthof(urcprefix); ++i) {
+		if (!udiald_tty_prefixed(line, urcprefix[i]))
+			continue;
+
+		// Look up the command name (everything up to the colon)
+		// in the last command sent
+		size_t n = strcspn(line, ":");
+		for (const char *cmd = lastcmd; (cmd = strchr(cmd, line[0])); ++cmd) {
+			if (!strncmp(cmd, line, n) && cmd[n] && strchr("=?;\r", cmd[n]))
+				return false;
 		}
-		if (rxed == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-			syslog(LOG_ERR, "Read failed: %s", strerror(errno));
-			return -1;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Put a URC on the queue, to be passed to the subscribed handlers by
+ * udiald_tty_urc_dispatch.
+ */
+static void udiald_tty_urc_queue(const char *line, size_t len) {
+	struct udiald_urc *u;
+	if (urcqueued == UDIALD_URC_QUEUE_MAX) {
+		u = list_first_entry(&urcqueue, struct udiald_urc, h);
+		syslog(LOG_WARNING, "URC queue full, dropping %s", u->line);
+		list_del(&u->h);
+		free(u);
+		urcqueued--;
+	}
+
+	u = malloc(sizeof(*u) + len + 1);
+	if (!u) {
+		syslog(LOG_ERR, "Failed to queue URC: %s", strerror(errno));
+		return;
+	}
+	memcpy(u->line, line, len + 1);
+	list_add_tail(&u->h, &urcqueue);
+	urcqueued++;
+}
+
+/**
+ * Start passing URCs starting with h->prefix (or all URCs, if prefix is
+ * NULL) to h->cb.
+ */
+void udiald_tty_urc_subscribe(struct udiald_urc_handler *h) {
+	list_add_tail(&h->h, &urchandlers);
+}
+
+void udiald_tty_urc_unsubscribe(struct udiald_urc_handler *h) {
+	list_del(&h->h);
+}
+
+/**
+ * Pass all queued URCs to the subscribed handlers and empty the
+ * queue. URCs that are not handled by any handler are dropped.
+ *
+ * This is called automatically by udiald_tty_get and
+ * udiald_tty_drain, once the reply to a command is complete. Handlers
+ * must not send commands themselves.
+ */
+void udiald_tty_urc_dispatch(void) {
+	struct udiald_urc *u, *tmp;
+	list_for_each_entry_safe(u, tmp, &urcqueue, h) {
+		bool handled = false;
+		struct udiald_urc_handler *h, *htmp;
+		list_for_each_entry_safe(h, htmp, &urchandlers, h) {
+			if (!h->prefix || udiald_tty_prefixed(u->line, h->prefix)) {
+				h->cb(h, u->line);
+				handled = true;
+			}
+		}
+		if (!handled)
+			syslog(LOG_DEBUG, "Ignoring unsolicited %s", u->line);
+		list_del(&u->h);
+		free(u);
+		urcqueued--;
+	}
+}
+
+/**
+ * Process any input that is pending on the given fd, without waiting.
+ * URCs are queued and dispatched, any other lines are leftovers from
+ * earlier commands and are discarded.
+ *
+ * Use this before sending a command to make sure stale replies are not
+ * mistaken for the reply to the new command.
+ */
+void udiald_tty_drain(int fd) {
+	struct udiald_tty_buf *b = udiald_tty_buf(fd);
+	if (!b)
+		return;
+
+	do {
+		char *line;
+		size_t len;
+		while ((line = udiald_tty_next_line(b, &len))) {
+			syslog(LOG_DEBUG, "Read: %s", line);
+			if (udiald_tty_is_urc(line, NULL))
+				udiald_tty_urc_queue(line, len);
+			else
+				syslog(LOG_DEBUG, "Discarding stale %s", line);
+		}
+		udiald_tty_compact(b);
+	} while ((b->end < b->size || udiald_tty_grow(b, NULL) == 0)
+		&& udiald_tty_fill(b, 0) == 0);
+
+	udiald_tty_urc_dispatch();
+}
+
+/**
+ * Prepare for receiving the reply to a command: throw away the
+ * previous reply, to make room for this one, and reset r.
+ */
+static void udiald_tty_reply_begin(struct udiald_tty_buf *b, struct udiald_tty_read *r) {
+	r->lines = 0;
+	r->line = b->lines;
+	r->result_line = NULL;
+	r->latency_ms = 0;
+	udiald_tty_compact(b);
+}
+
+/**
+ * Add all complete lines in the input buffer to the reply in r, up to
+ * and including the final result code. URCs are queued instead.
+ *
+ * Returns the final result code, or UDIALD_FAIL with errno set to
+ * EAGAIN when it was not received yet (or ENOMEM when allocating memory
+ * failed).
+ */
+static enum udiald_atres udiald_tty_reply_parse(struct udiald_tty_buf *b, struct udiald_tty_read *r, const char *result_prefix) {
+	enum udiald_atres res = UDIALD_FAIL;
+	char *line;
+	size_t len;
+
+	while (res == UDIALD_FAIL && (line = udiald_tty_next_line(b, &len))) {
+		syslog(LOG_DEBUG, "Read: %s", line);
+
+		if (udiald_tty_is_urc(line, result_prefix)) {
+			udiald_tty_urc_queue(line, len);
+			continue;
+		}
+
+		if (r->lines == b->maxlines) {
+			struct udiald_tty_line *lines = realloc(b->lines, 2 * b->maxlines * sizeof(*lines));
+			if (!lines) {
+				syslog(LOG_ERR, "Failed to allocate reply lines: %s", strerror(errno));
+				errno = ENOMEM;
+				return UDIALD_FAIL;
+			}
+			r->line = b->lines = lines;
+			b->maxlines *= 2;
 		}
 
+		r->line[r->lines].s = line;
+		r->line[r->lines].len = len;
+		r->lines++;
+
+		// See if the current line starts with the
+		// given prefix
+		if (!r->result_line && result_prefix && udiald_tty_prefixed(line, result_prefix))
+		    r->result_line = line;
+
+		// See if this is the final result code
+		res = udiald_tty_result_code(line, len, b->numeric);
+	}
+	if (res == UDIALD_FAIL)
+		errno = EAGAIN;
+	return res;
+}
+
+// Retrieve answer from modem. The timeout (in ms) applies to the
+// reply as a whole, not to individual reads.
+//
+// The lines returned in r point into the input buffer for fd and are
+// valid until the next call to udiald_tty_get or udiald_tty_drain for
+// the same fd.
+enum udiald_atres udiald_tty_get(int fd, struct udiald_tty_read *r, const char *result_prefix, int timeout) {
+	struct udiald_tty_buf *b = udiald_tty_buf(fd);
+	uint64_t start = udiald_util_monotonic_ms();
+	uint64_t deadline = start + timeout;
+	// Measure latency from the moment the command was sent, if
+	// that is what we are waiting for.
+	uint64_t sent = (lastput && lastput <= start) ? lastput : start;
+	lastput = 0;
+
+	enum udiald_atres res = UDIALD_FAIL;
+	r->lines = 0;
+	r->line = NULL;
+	r->result_line = NULL;
+	r->latency_ms = 0;
+
+	if (!b)
+		return UDIALD_FAIL;
+
+	udiald_tty_reply_begin(b, r);
+
+	// Modems are evil, they might not send the complete answer when doing
+	// a read, so we read until we get a known AT status code (see top).
+	// Any bytes following the status code are kept in the input buffer
+	// for the next call.
+	while ((res = udiald_tty_reply_parse(b, r, result_prefix)) == UDIALD_FAIL) {
+		if (errno != EAGAIN)
+			goto out;
+
+		// Make room for more data, if needed
+		if (b->end == b->size && udiald_tty_grow(b, r))
+			goto out;
+
+		// Wait only for what remains of the timeout, so a modem
+		// that keeps sending data cannot stretch it.
+		uint64_t now = udiald_util_monotonic_ms();
+		if (now >= deadline)
+			errno = ETIMEDOUT;
+		if (now >= deadline || udiald_tty_fill(b, deadline - now)) {
+			if (errno == ETIMEDOUT)
+				syslog(LOG_ERR, "No complete response received within %d ms", timeout);
+			goto out;
+		}
 	}
 
-	syslog(LOG_ERR, "No complete response received within %zu bytes", lengthof(r->raw_buf));
-	errno = ERANGE;
-	return -1;
+	r->latency_ms = udiald_util_monotonic_ms() - sent;
+	syslog(LOG_DEBUG, "Reply completed after %u ms", r->latency_ms);
+
+out:
+	udiald_tty_urc_dispatch();
+	return res;
 }
 
-int udiald_tty_cloexec(int fd) {
-	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
-	return fd;
+/**
+ * Start waiting for the reply to a command without blocking, for use
+ * with an event loop. Call udiald_tty_reply_feed whenever the fd
+ * becomes readable, until it returns the final result code.
+ *
+ * Returns 0 on success, or -1 when allocating the input buffer failed.
+ */
+int udiald_tty_reply_start(int fd, struct udiald_tty_read *r) {
+	struct udiald_tty_buf *b = udiald_tty_buf(fd);
+	r->lines = 0;
+	r->line = NULL;
+	r->result_line = NULL;
+	r->latency_ms = 0;
+	if (!b)
+		return -1;
+
+	udiald_tty_reply_begin(b, r);
+	return 0;
 }
 
-pid_t udiald_tty_pppd(struct udiald_state *state) {
-	char cpath[18 + sizeof(state->networkname) + sizeof(pid_t) * 3];
-	snprintf(cpath, sizeof(cpath), "/tmp/udiald-pppd-%s-%d", state->networkname, getpid());
-	if (unlink(cpath) < 0 && errno != ENOENT) {
-		syslog(LOG_CRIT, "%s: Failed to clean up existing ppp config file: %s",
-				state->modem.device_id, strerror(errno));
-		return 0;
+/**
+ * Read whatever input is available on the fd, without waiting, and
+ * add it to the reply started by udiald_tty_reply_start.
+ *
+ * Returns the final result code once it is received. Until then,
+ * returns UDIALD_FAIL with errno set to EAGAIN. Any other errno
+ * means the reply cannot be completed.
+ *
+ * Like with udiald_tty_get, the lines in r are valid until the next
+ * reply is started on the same fd. Queued URCs are dispatched once
+ * the reply is complete.
+ */
+enum udiald_atres udiald_tty_reply_feed(int fd, struct udiald_tty_read *r, const char *result_prefix) {
+	struct udiald_tty_buf *b = udiald_tty_buf(fd);
+	if (!b)
+		return UDIALD_FAIL;
+
+	enum udiald_atres res = udiald_tty_reply_parse(b, r, result_prefix);
+	if (res == UDIALD_FAIL && errno == EAGAIN) {
+		if (b->end == b->size && udiald_tty_grow(b, r))
+			return UDIALD_FAIL;
+		if (udiald_tty_fill(b, 0) == 0)
+			res = udiald_tty_reply_parse(b, r, result_prefix);
+		else if (errno == ETIMEDOUT)
+			errno = EAGAIN;
 	}
+	if (res == UDIALD_FAIL)
+		return res;
+
+	r->latency_ms = lastput ? udiald_util_monotonic_ms() - lastput : 0;
+	lastput = 0;
+	syslog(LOG_DEBUG, "Reply completed after %u ms", r->latency_ms);
+	udiald_tty_urc_dispatch();
+	return res;
+}
 
-	// Create config file
-	FILE *fp;
-	int cfd = open(cpath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-	if (cfd < 0) {
-		syslog(LOG_CRIT, "%s: Failed to create ppp config file: %s",
-				state->modem.device_id, strerror(errno));
-		return 0;
+/**
+ * Close a tty opened with udiald_tty_open, dropping any buffered input
+ * for it.
+ */
+void udiald_tty_close(int fd) {
+	struct udiald_tty_buf *b;
+	list_for_each_entry(b, &ttybufs, h) {
+		if (b->fd == fd) {
+			list_del(&b->h);
+			free(b->data);
+			free(b->lines);
+			free(b);
+			break;
+		}
 	}
+	close(fd);
+}
 
-	if (!(fp = fdopen(cfd, "w"))) {
-		syslog(LOG_CRIT, "%s: Failed to create FILE* for ppp config file: %s",
+int udiald_tty_cloexec(int fd) {
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	return fd;
+}
+
+/**
+ * Build the pppd options for the data tty (see udiald_tty_pppd), in the
+ * format of a pppd options file. Returns a malloced string, or NULL on
+ * failure.
+ */
+static char *udiald_tty_pppd_options(struct udiald_state *state, int ttyfd) {
+	char *text;
+	size_t len;
+	FILE *fp = open_memstream(&text, &len);
+	if (!fp) {
+		syslog(LOG_CRIT, "%s: Failed to create ppp options: %s",
 				state->modem.device_id, strerror(errno));
-		close(cfd);
-		return 0;
+		return NULL;
 	}
 
-	char buf[256];
+	char buf[PATH_MAX + 128];
 
-	fputs("/dev/", fp);
-	fputs(state->modem.dat_tty, fp);
-	fputs("\n460800\ncrtscts\nlock\n"
+	// Without a device, pppd uses the tty on stdin
+	if (ttyfd == -1)
+		fprintf(fp, "%s/dev/%s\n", state->sysroot, state->modem.dat_tty);
+	fputs("460800\ncrtscts\nlock\n"
 		"noauth\nnoipdefault\nnovj\nnodetach\n", fp);
 
 	char *ifname;
@@ -243,14 +797,16 @@ pid_t udiald_tty_pppd(struct udiald_state *state) {
 		fputs("\"\n", fp);
 	}
 
-	// We need to pass ourselve as connect script so get our path from /proc
-	memcpy(buf, "connect \"", 9);
-	ssize_t l = readlink("/proc/self/exe", buf + 9, sizeof(buf) - 10);
-	/* Pass on relevant options */
-	char *verbose_opts = (verbose == 0 ? "" : verbose == 1 ? " -v" : " -v -v");
-	snprintf(buf + 9 + l, sizeof(buf) - 9 - l, " -d -n%s -D%s -p%s %s\"\n", state->networkname, state->modem.device_id, state->modem.profile->name, verbose_opts);
-	fputs(buf, fp);
-	printf("%s", buf);
+	if (ttyfd == -1) {
+		// We need to pass ourselve as connect script so get our path from /proc
+		memcpy(buf, "connect \"", 9);
+		ssize_t l = readlink("/proc/self/exe", buf + 9, sizeof(buf) - 10);
+		/* Pass on relevant options */
+		char *verbose_opts = (verbose == 0 ? "" : verbose == 1 ? " -v" : " -v -v");
+		snprintf(buf + 9 + l, sizeof(buf) - 9 - l, " -d -n%s -D%s -p%s%s%s %s\"\n", state->networkname, state->modem.device_id, state->modem.profile->name,
+			state->sysroot[0] ? " --sysroot " : "", state->sysroot, verbose_opts);
+		fputs(buf, fp);
+	}
 
 	// Set linkname and ipparam
 	fprintf(fp, "linkname \"%s\"\nipparam \"%s\"\n", state->networkname, state->networkname);
@@ -266,7 +822,8 @@ pid_t udiald_tty_pppd(struct udiald_state *state) {
 	if ((val = udiald_config_get_int(state, "usepeerdns", 1)) != 0) {
 		fputs("usepeerdns\n", fp);
 	}
-	if ((val = udiald_config_get_int(state, "persist", 1)) != 0) {
+	// pppd cannot redial by itself when we dialed
+	if (ttyfd == -1 && (val = udiald_config_get_int(state, "persist", 1)) != 0) {
 		fputs("persist\n", fp);
 	}
 	if ((val = udiald_config_get_int(state, "unit", -1)) > 0) {
@@ -313,20 +870,89 @@ pid_t udiald_tty_pppd(struct udiald_state *state) {
 		free(p->val);
 		free(p);
 	}
-	fclose(fp);
-
-	char *const argv[] = {"/usr/sbin/pppd", "file", cpath, NULL};
-	pid_t pid = vfork();
-	if (pid == 0) {
-		execv(argv[0], argv);
-		syslog(LOG_CRIT, "%s: Failed to exec %s: %s",
-				state->modem.device_id, argv[0], strerror(errno));
-		_exit(128);
-	} else if (pid == -1) {
-		syslog(LOG_CRIT, "%s: Failed to fork for pppd: %s",
+	if (fclose(fp)) {
+		syslog(LOG_CRIT, "%s: Failed to create ppp options: %s",
+				state->modem.device_id, strerror(errno));
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+/**
+ * Start pppd for the data tty. Normally, pppd opens the tty and runs
+ * udiald as its connect script to dial. When ttyfd is not -1, it is a
+ * tty on which dialing already succeeded and it is passed to pppd as
+ * its stdin instead, which pppd then uses as its device.
+ *
+ * snapshot is passed to the dialer in the environment (see
+ * udiald_modem_snapshot), or NULL when there is none.
+ *
+ * The options are passed through a pipe, which pppd reads as its
+ * options file (/proc/self/fd/3), so nothing is written to the
+ * filesystem. They are only built once per process, since the config
+ * does not change while we run.
+ *
+ * Returns the pid of pppd, or 0 on failure.
+ */
+pid_t udiald_tty_pppd(struct udiald_state *state, int ttyfd, const char *snapshot) {
+	static char *opts[2];
+	char **o = &opts[ttyfd != -1];
+	if (!*o && !(*o = udiald_tty_pppd_options(state, ttyfd)))
+		return 0;
+
+	// The options have to fit in the pipe buffer, since pppd only
+	// starts reading once it runs
+	int pfd[2];
+	size_t len = strlen(*o);
+	if (pipe2(pfd, O_CLOEXEC | O_NONBLOCK)) {
+		syslog(LOG_CRIT, "%s: Failed to create pipe for ppp options: %s",
 				state->modem.device_id, strerror(errno));
 		return 0;
-	} else {
-		return pid;
 	}
+	ssize_t w = write(pfd[1], *o, len);
+	close(pfd[1]);
+	if (w != (ssize_t)len) {
+		syslog(LOG_CRIT, "%s: Failed to pass ppp options: %s",
+				state->modem.device_id, w < 0 ? strerror(errno) : "too long");
+		close(pfd[0]);
+		return 0;
+	}
+	// dup2 to the same fd would keep close-on-exec set
+	if (pfd[0] == UDIALD_PPPD_OPTFD) {
+		int fd = fcntl(pfd[0], F_DUPFD_CLOEXEC, UDIALD_PPPD_OPTFD + 1);
+		close(pfd[0]);
+		pfd[0] = fd;
+	}
+	fcntl(pfd[0], F_SETFL, 0);
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	if (ttyfd != -1)
+		posix_spawn_file_actions_adddup2(&fa, ttyfd, 0);
+	posix_spawn_file_actions_adddup2(&fa, pfd[0], UDIALD_PPPD_OPTFD);
+
+	char pppd[PATH_MAX];
+	snprintf(pppd, sizeof(pppd), "%s/usr/sbin/pppd", state->sysroot);
+	char optpath[32];
+	snprintf(optpath, sizeof(optpath), "/proc/self/fd/%d", UDIALD_PPPD_OPTFD);
+	char *const argv[] = {pppd, "file", optpath, NULL};
+
+	// Pass the modem on to the dialer that pppd starts, so it does not
+	// have to look for it again
+	if (snapshot)
+		setenv(UDIALD_SNAPSHOT_ENV, snapshot, 1);
+	else
+		unsetenv(UDIALD_SNAPSHOT_ENV);
+
+	pid_t pid;
+	int e = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(pfd[0]);
+	if (e) {
+		syslog(LOG_CRIT, "%s: Failed to start %s: %s",
+				state->modem.device_id, argv[0], strerror(e));
+		return 0;
+	}
+	return pid;
 }
@@ -0,0 +1,260 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * ubus object for a connecting udiald, named udiald.<network>, so
+ * management tools can query and control it without starting another
+ * udiald. Methods:
+ *
+ *   status      The values from the var store (see var.c), plus the
+ *               device and profile in use
+ *   devices     Usable devices, like --list-devices (cached, see scan)
+ *   profiles    Known profiles, like --list-profiles
+ *   scan        Look for devices again, and return them like devices
+ *   history     Signal and radio history (see history.c)
+ *   connect     Connect when standing by (resident mode only)
+ *   disconnect  End the connection (same as SIGHUP)
+ *
+ * Subscribers get a "status" notification, with the same contents as
+ * the status method, whenever the status is saved.
+ *
+ * Requests are only handled while udiald runs its event loop (while
+ * connected or standing by), not while it sets up the modem or dials.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <libubus.h>
+#include <libubox/blobmsg_json.h>
+#include "udiald.h"
+
+static struct ubus_context *ctx;
+static struct udiald_state *ubus_state;
+static struct blob_buf b;
+static struct json_object *devices; /* Devices found by the last scan */
+static char objname[48];
+static bool lost;
+
+// Values that are numbers rather than strings in the status
+static const enum blobmsg_type vartype[UDIALD_NUM_VARS] = {
+	[UDIALD_VAR_PID] = BLOBMSG_TYPE_INT32,
+	[UDIALD_VAR_CONNECTED] = BLOBMSG_TYPE_BOOL,
+	[UDIALD_VAR_RSSI] = BLOBMSG_TYPE_INT32,
+	[UDIALD_VAR_BER] = BLOBMSG_TYPE_INT32,
+	[UDIALD_VAR_MODEM_GSM] = BLOBMSG_TYPE_BOOL,
+	[UDIALD_VAR_ERROR_CODE] = BLOBMSG_TYPE_INT32,
+	[UDIALD_VAR_RX_BYTES ... UDIALD_VAR_MODEM_TX_BYTES] = BLOBMSG_TYPE_INT64,
+	[UDIALD_VAR_SIGNAL_RSSI ... UDIALD_VAR_SIGNAL_SINR] = BLOBMSG_TYPE_DOUBLE,
+};
+
+static void udiald_ubus_add_status(struct udiald_state *state) {
+	blobmsg_add_string(&b, "network", state->networkname);
+	if (state->modem.device_id[0])
+		blobmsg_add_string(&b, "device", state->modem.device_id);
+	if (state->modem.profile)
+		blobmsg_add_string(&b, "profile", state->modem.profile->name);
+	blobmsg_add_u8(&b, "resident", !!(state->flags & UDIALD_FLAG_RESIDENT));
+
+	for (int i = 0; i < UDIALD_NUM_VARS; ++i) {
+		const char *val = udiald_var_get(state, i);
+		if (!val)
+			continue;
+		if (vartype[i] == BLOBMSG_TYPE_DOUBLE)
+			blobmsg_add_double(&b, udiald_var_name(i), strtod(val, NULL));
+		else if (vartype[i] == BLOBMSG_TYPE_INT64)
+			blobmsg_add_u64(&b, udiald_var_name(i), strtoull(val, NULL, 10));
+		else if (vartype[i] == BLOBMSG_TYPE_INT32)
+			blobmsg_add_u32(&b, udiald_var_name(i), atoi(val));
+		else if (vartype[i] == BLOBMSG_TYPE_BOOL)
+			blobmsg_add_u8(&b, udiald_var_name(i), atoi(val) != 0);
+		else
+			blobmsg_add_string(&b, udiald_var_name(i), val);
+	}
+}
+
+static int udiald_ubus_status(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	blob_buf_init(&b, 0);
+	udiald_ubus_add_status(ubus_state);
+	ubus_send_reply(ctx, req, b.head);
+	return UBUS_STATUS_OK;
+}
+
+static void udiald_ubus_scan_devices(void) {
+	struct udiald_device_filter filter = {0};
+	if (devices)
+		json_object_put(devices);
+	int e = udiald_modem_devices_json(ubus_state, &filter, &devices);
+	if (e != UDIALD_OK && e != UDIALD_ENODEV)
+		syslog(LOG_ERR, "Error while detecting devices");
+}
+
+static int udiald_ubus_devices(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	if (!devices || !strcmp(method, "scan"))
+		udiald_ubus_scan_devices();
+	blob_buf_init(&b, 0);
+	blobmsg_add_object(&b, devices);
+	ubus_send_reply(ctx, req, b.head);
+	return UBUS_STATUS_OK;
+}
+
+static int udiald_ubus_history(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	blob_buf_init(&b, 0);
+	udiald_history_add_blob(&b);
+	ubus_send_reply(ctx, req, b.head);
+	return UBUS_STATUS_OK;
+}
+
+static int udiald_ubus_profiles(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	struct json_object *profiles = udiald_modem_profiles_json(ubus_state);
+	blob_buf_init(&b, 0);
+	blobmsg_add_object(&b, profiles);
+	json_object_put(profiles);
+	ubus_send_reply(ctx, req, b.head);
+	return UBUS_STATUS_OK;
+}
+
+/*
+ * connect and disconnect raise the signals that do the same, so they
+ * are handled in exactly the same way (see udiald_resident_main).
+ */
+static int udiald_ubus_connect(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	if (!(ubus_state->flags & UDIALD_FLAG_RESIDENT))
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	// Only standby waits for a connect request, otherwise we are
+	// connected or dialing already (and SIGUSR2 would reconnect)
+	const char *st = udiald_var_get(ubus_state, UDIALD_VAR_STATE);
+	if (st && !strcmp(st, "standby"))
+		raise(SIGUSR2);
+	return UBUS_STATUS_OK;
+}
+
+static int udiald_ubus_disconnect(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	raise(SIGHUP);
+	return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method udiald_ubus_methods[] = {
+	UBUS_METHOD_NOARG("status", udiald_ubus_status),
+	UBUS_METHOD_NOARG("devices", udiald_ubus_devices),
+	UBUS_METHOD_NOARG("profiles", udiald_ubus_profiles),
+	UBUS_METHOD_NOARG("scan", udiald_ubus_devices),
+	UBUS_METHOD_NOARG("history", udiald_ubus_history),
+	UBUS_METHOD_NOARG("connect", udiald_ubus_connect),
+	UBUS_METHOD_NOARG("disconnect", udiald_ubus_disconnect),
+};
+
+static struct ubus_object_type udiald_ubus_type = UBUS_OBJECT_TYPE("udiald", udiald_ubus_methods);
+
+static struct ubus_object udiald_ubus_object = {
+	.name = objname,
+	.type = &udiald_ubus_type,
+	.methods = udiald_ubus_methods,
+	.n_methods = lengthof(udiald_ubus_methods),
+};
+
+static void udiald_ubus_connection_lost(struct ubus_context *ctx) {
+	// The default handler ends the event loop, which would end the
+	// connection. Try again on the next udiald_ubus_attach instead.
+	syslog(LOG_WARNING, "Lost the connection to ubus");
+	if (ctx->sock.registered)
+		uloop_fd_delete(&ctx->sock);
+	lost = true;
+}
+
+/**
+ * Connect to ubus and add the udiald.<network> object. udiald runs
+ * fine without ubus, so failing is not fatal.
+ */
+void udiald_ubus_init(struct udiald_state *state) {
+	ubus_state = state;
+	snprintf(objname, sizeof(objname), "udiald.%s", state->networkname);
+
+	ctx = ubus_connect(NULL);
+	if (!ctx) {
+		syslog(LOG_INFO, "Not connected to ubus");
+		return;
+	}
+	// pppd and the DHCP client don't need it
+	udiald_tty_cloexec(ctx->sock.fd);
+	ctx->connection_lost = udiald_ubus_connection_lost;
+
+	int ret = ubus_add_object(ctx, &udiald_ubus_object);
+	if (ret) {
+		syslog(LOG_WARNING, "Failed to add ubus object %s: %s", objname, ubus_strerror(ret));
+		ubus_free(ctx);
+		ctx = NULL;
+	}
+}
+
+/**
+ * Handle ubus requests from the uloop event loop. Call this after
+ * every uloop_init, and udiald_ubus_detach before uloop_done.
+ */
+void udiald_ubus_attach(void) {
+	if (!ctx)
+		return;
+	if (lost) {
+		if (ubus_reconnect(ctx, NULL))
+			return;
+		udiald_tty_cloexec(ctx->sock.fd);
+		lost = false;
+		syslog(LOG_NOTICE, "Reconnected to ubus");
+	}
+	ubus_add_uloop(ctx);
+}
+
+void udiald_ubus_detach(void) {
+	if (ctx && ctx->sock.registered)
+		uloop_fd_delete(&ctx->sock);
+}
+
+/**
+ * Notify subscribers of the current status. Called whenever changed
+ * values are saved, see var.c.
+ */
+void udiald_ubus_notify(struct udiald_state *state) {
+	if (!ctx || lost || !udiald_ubus_object.has_subscribers)
+		return;
+	blob_buf_init(&b, 0);
+	udiald_ubus_add_status(state);
+	ubus_notify(ctx, &udiald_ubus_object, "status", b.head, -1);
+}
+
+void udiald_ubus_done(void) {
+	if (ctx) {
+		udiald_ubus_detach();
+		ubus_free(ctx);
+		ctx = NULL;
+	}
+	if (devices) {
+		json_object_put(devices);
+		devices = NULL;
+	}
+	blob_buf_free(&b);
+}
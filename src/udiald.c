@@ -38,7 +38,13 @@
 #include "config.h"
 
 static volatile int signaled = 0;
-static struct udiald_state state = {.uciname = "network", .networkname = "wan", .format = UDIALD_FORMAT_JSON};
+// Set by SIGUSR2 in resident mode, while standing by
+static volatile int connect_requested = 0;
+// Standing by in resident mode, see udiald_resident_standby
+static volatile int standby = 0;
+static struct udiald_state state = {.uciname = "network", .networkname = "wan", .format = UDIALD_FORMAT_JSON, .sysroot = ""};
+// Asynchronous command channel on the control tty, while connected
+static struct udiald_at_channel atchan;
 int verbose = 0;
 
 // UCI config section to use for global values
@@ -69,12 +75,17 @@ static int udiald_usage(const char *app) {
 			"	-p, --profile <profilename>	Use the profile with the given name instead of autodetecting a\n"
 			"					profile to use. Run with -L to get a list of valid profiles.\n"
 			"       --pin <pin>                     Use the given pin, instead of loading it from the config file\n"
+			"	--sysroot <dir>			Look for sysfs, device nodes, uci config and pppd below the\n"
+			"					given directory instead of /. Used for testing.\n"
 			"	--usable			Only consider devices that are usable (i.e., for which a\n"
 			"					configuration profile is available). This is enabled by default\n"
 			"					with --connect, but disabled by default with the listing options.\n"
 			"Connect Options:\n"
 			"	-t				Test state file for previous SIM-unlocking\n"
-			"					errors before attempting to connect\n\n"
+			"					errors before attempting to connect\n"
+			"	--resident			Keep running after the connection ends, with the modem\n"
+			"					ready for the next one. SIGHUP disconnects, SIGUSR2\n"
+			"					connects again.\n\n"
 			"List options (valid for -L and -l):\n"
 			"	-f, --format <format>		Sets the output format. Supported formats are \"json\" and \"id\".\n"
 			"Return Codes:\n"
@@ -96,10 +107,26 @@ static int udiald_usage(const char *app) {
 
 static void udiald_catch_signal(int signal) {
 	if (!signaled) signaled = signal;
+	// Stop waiting for the modem (e.g. while dialing in resident mode)
+	if (signal != SIGCHLD)
+		udiald_tty_interrupted = 1;
+	uloop_end();
+}
+
+static void udiald_request_connect(int signal) {
+	// Only standby waits for a connect request. While setting up the
+	// modem, dialing or connected (or without resident mode), there is
+	// nothing to do.
+	if (!standby)
+		return;
+	connect_requested = 1;
+	uloop_end();
 }
 
 // Signal safe cleanup function
 static void udiald_cleanup_safe(int signal) {
+	// Also covers the dialer, which talks to the modem on fd 0
+	udiald_tty_interrupted = 1;
 	if (state.ctlfd > 0) {
 		close(state.ctlfd);
 		state.ctlfd = -1;
@@ -114,6 +141,8 @@ static void udiald_cleanup() {
 		ucix_cleanup(state.uci);
 		state.uci = NULL;
 	}
+	udiald_shm_close();
+	udiald_ubus_done();
 	udiald_cleanup_safe(0);
 }
 
@@ -123,36 +152,34 @@ static void udiald_exitcode(int code, const char *fmt, ...) {
 	if (code && state.flags & UDIALD_FLAG_SIGNALED)
 		code = UDIALD_ESIGNALED;
 	if (code && code != UDIALD_ESIGNALED) {
-		udiald_config_set_int(&state, "udiald_error_code", code);
+		// Keep the modem traffic and link status that led up to the error
+		udiald_trace_dump(NULL);
+		udiald_history_dump(NULL);
+		udiald_var_set_int(&state, UDIALD_VAR_ERROR_CODE, code);
 		if (fmt) {
 			va_start(ap, fmt);
 			vsnprintf(buf, lengthof(buf), fmt, ap);
 			va_end(ap);
-			udiald_config_set(&state, "udiald_error_msg", buf);
+			udiald_var_set(&state, UDIALD_VAR_ERROR_MSG, buf);
 
 			if (state.modem.device_id[0])
 				syslog(LOG_CRIT, "%s: %s", state.modem.device_id, buf);
 			else
 				syslog(LOG_CRIT, "%s", buf);
 		} else {
-			udiald_config_revert(&state, "udiald_error_msg");
+			udiald_var_unset(&state, UDIALD_VAR_ERROR_MSG);
 		}
 	}
 	if (state.app == UDIALD_APP_CONNECT) {
 		if (code != UDIALD_OK)
-			udiald_config_set(&state, "udiald_state", "error");
+			udiald_var_set(&state, UDIALD_VAR_STATE, "error");
 		else
-			udiald_config_revert(&state, "udiald_state");
+			udiald_var_unset(&state, UDIALD_VAR_STATE);
 	}
-	ucix_save(state.uci, state.uciname);
+	udiald_var_commit(&state);
 	exit(code);
 }
 
-static void sleep_seconds(int seconds) {
-	const struct timespec ts = {.tv_sec = seconds};
-	nanosleep(&ts, NULL);
-}
-
 /* Constants to return for long options withou a corresponding short
  * option. Long options with an equivalent short option just use the
  * short option char.
@@ -163,6 +190,8 @@ enum long_options {
 	UDIALD_OPT_USABLE = UCHAR_MAX + 1,
 	UDIALD_OPT_PROBE,
 	UDIALD_OPT_PIN,
+	UDIALD_OPT_SYSROOT,
+	UDIALD_OPT_RESIDENT,
 };
 
 static struct option longopts[] = {
@@ -185,6 +214,8 @@ static struct option longopts[] = {
 	{"usable", false, NULL, UDIALD_OPT_USABLE},
 	{"probe", false, NULL, UDIALD_OPT_PROBE},
 	{"pin", true, NULL, UDIALD_OPT_PIN},
+	{"sysroot", true, NULL, UDIALD_OPT_SYSROOT},
+	{"resident", false, NULL, UDIALD_OPT_RESIDENT},
 	{0},
 };
 
@@ -267,6 +298,12 @@ static enum udiald_app udiald_parse_cmdline(struct udiald_state *state, int argc
 			case UDIALD_OPT_PIN:
 				state->pin = strdup(optarg);
 				break;
+			case UDIALD_OPT_SYSROOT:
+				state->sysroot = optarg;
+				break;
+			case UDIALD_OPT_RESIDENT:
+				state->flags |= UDIALD_FLAG_RESIDENT;
+				break;
 			case 'f':
 				if (!strcmp(optarg, "json")) {
 					state->format = UDIALD_FORMAT_JSON;
@@ -310,7 +347,11 @@ static void udiald_setup_syslog(struct udiald_state *state) {
 
 static void udiald_setup_uci(struct udiald_state *state) {
 	// Prepare and initialize state
-	if (!(state->uci = ucix_init(state->uciname, 1))) {
+	if (state->sysroot[0])
+		state->uci = ucix_init_path(state->sysroot, state->uciname, 1);
+	else
+		state->uci = ucix_init(state->uciname, 1);
+	if (!state->uci) {
 		exit(UDIALD_EINTERNAL);
 	}
 	ucix_add_section(state->uci, state->uciname, UCI_SECTION_GLOBAL, "udiald");
@@ -320,6 +361,40 @@ static void udiald_setup_uci(struct udiald_state *state) {
 	errno = 0;
 }
 
+static void udiald_setup_trace(struct udiald_state *state) {
+	char *file = udiald_config_get(state, "udiald_trace_file");
+	if (file && *file) {
+		udiald_trace_set_file(file);
+	} else {
+		char path[128];
+		snprintf(path, sizeof(path), "/tmp/udiald-%s%s.trace", state->networkname,
+			(state->app == UDIALD_APP_DIAL) ? "-dialer" : "");
+		udiald_trace_set_file(path);
+	}
+	free(file);
+
+	// Only the connecting udiald keeps a history
+	if (state->app != UDIALD_APP_CONNECT)
+		return;
+	file = udiald_config_get(state, "udiald_history_file");
+	if (file && *file) {
+		udiald_history_set_file(file);
+	} else {
+		char path[128];
+		snprintf(path, sizeof(path), "/tmp/udiald-%s.history", state->networkname);
+		udiald_history_set_file(path);
+	}
+	free(file);
+}
+
+// Write out the wire trace and the signal history on request
+static void udiald_dump_trace(int signal) {
+	int err = errno;
+	udiald_trace_dump(NULL);
+	udiald_history_dump(NULL);
+	errno = err;
+}
+
 /**
  * Select the modem to use, depending on config or autodetection.
  */
@@ -336,8 +411,8 @@ void udiald_select_modem(struct udiald_state *state) {
 	snprintf(b, sizeof(b), "%04x:%04x", state->modem.vendor, state->modem.device);
 	syslog(LOG_NOTICE, "%s: Found %s modem %s", state->modem.device_id,
 			state->modem.driver, b);
-	udiald_config_set(state, "modem_id", b);
-	udiald_config_set(state, "modem_driver", state->modem.driver);
+	udiald_var_set(state, UDIALD_VAR_MODEM_ID, b);
+	udiald_var_set(state, UDIALD_VAR_MODEM_DRIVER, state->modem.driver);
 
 	b[0] = '\0';
 	// Writing modestrings
@@ -356,8 +431,8 @@ void udiald_select_modem(struct udiald_state *state) {
  */
 static void udiald_open_control(struct udiald_state *state) {
 	// Open control connection
-	char ttypath[24];
-	snprintf(ttypath, sizeof(ttypath), "/dev/%s", state->modem.ctl_tty);
+	char ttypath[PATH_MAX];
+	snprintf(ttypath, sizeof(ttypath), "%s/dev/%s", state->sysroot, state->modem.ctl_tty);
 	if ((state->ctlfd = udiald_tty_cloexec(udiald_tty_open(ttypath))) == -1) {
 		udiald_exitcode(UDIALD_EMODEM, "Unable to open terminal");
 	}
@@ -367,34 +442,66 @@ static void udiald_open_control(struct udiald_state *state) {
  * Reset the modem through the control connection.
  */
 static void udiald_modem_reset(struct udiald_state *state) {
-	struct udiald_tty_read r;
+	struct udiald_tty_read r = {0};
+	// Optionally switch to numeric result codes (ATV0), which are
+	// shorter on the wire and cheaper to recognize. Otherwise,
+	// explicitly select verbose result codes, in case an earlier run
+	// left the modem in numeric mode.
+	bool numeric = udiald_config_get_int(state, "udiald_numeric", 0);
+	udiald_tty_set_numeric(state->ctlfd, numeric);
+
 	// Hangup modem, disable echoing
-	tcflush(state->ctlfd, TCIFLUSH);
-	udiald_tty_put(state->ctlfd, "ATE0\r");
+	udiald_tty_drain(state->ctlfd);
+	udiald_tty_put(state->ctlfd, numeric ? "ATE0V0\r" : "ATE0V1\r");
 	udiald_tty_get(state->ctlfd, &r, NULL, 2500);
-	tcflush(state->ctlfd, TCIFLUSH);
+	udiald_tty_drain(state->ctlfd);
+}
+
+// Queries sent by udiald_query_modem
+enum udiald_startup_query {
+	UDIALD_Q_CGMI,
+	UDIALD_Q_CGMM,
+	UDIALD_Q_CPIN,
+	UDIALD_Q_GCAP,
+};
+
+static struct udiald_tty_query startup_queries[] = {
+	[UDIALD_Q_CGMI] = {.cmd = "+CGMI"},
+	[UDIALD_Q_CGMM] = {.cmd = "+CGMM"},
+	[UDIALD_Q_CPIN] = {.cmd = "+CPIN?", .prefix = "+CPIN: "},
+	[UDIALD_Q_GCAP] = {.cmd = "+GCAP", .prefix = "+GCAP: "},
+};
+
+/**
+ * Send all queries needed during startup, combining them into as few
+ * command lines as possible. The results are evaluated by
+ * udiald_identify, udiald_check_sim and udiald_check_caps.
+ */
+static void udiald_query_modem(struct udiald_state *state) {
+	udiald_tty_batch(state->ctlfd, startup_queries, lengthof(startup_queries),
+			state->modem.profile->cfg.maxcmdlen, 2500);
 }
 
 /**
  * Query the modem for identification.
  */
 static void udiald_identify(struct udiald_state *state) {
-	struct udiald_tty_read r;
+	const struct udiald_tty_query *cgmi = &startup_queries[UDIALD_Q_CGMI];
+	const struct udiald_tty_query *cgmm = &startup_queries[UDIALD_Q_CGMM];
 	char b[512];
 	// Identify modem
-	if (udiald_tty_put(state->ctlfd, "AT+CGMI;+CGMM\r") < 1
-	|| udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK
-	|| r.lines < 3) {
+	if (cgmi->res != UDIALD_AT_OK || !cgmi->reply[0]
+	|| cgmm->res != UDIALD_AT_OK || !cgmm->reply[0]) {
 		udiald_exitcode(UDIALD_EMODEM, "Unable to identify modem");
 	}
-	snprintf(b, sizeof(b), "%s %s", r.raw_lines[0], r.raw_lines[1]);
+	snprintf(b, sizeof(b), "%s %s", cgmi->reply, cgmm->reply);
 	syslog(LOG_NOTICE, "%s: Identified as %s", state->modem.device_id, b);
-	udiald_config_set(state, "modem_name", b);
+	udiald_var_set(state, UDIALD_VAR_MODEM_NAME, b);
 }
 
 static void udiald_probe_cmd(struct udiald_state *state, const char *cmd, int timeout) {
 	char b[512] = {0};
-	struct udiald_tty_read r;
+	struct udiald_tty_read r = {0};
 	syslog(LOG_NOTICE, "Sending %s", cmd);
 	snprintf(b, sizeof(b) - 1, "%s\r", cmd);
 	if (udiald_tty_put(state->ctlfd, b) < 1
@@ -402,10 +509,10 @@ static void udiald_probe_cmd(struct udiald_state *state, const char *cmd, int ti
 		syslog(LOG_CRIT, "%s: %s failed (%s)", state->modem.device_id, cmd, udiald_tty_flatten_result(&r));
 	} else {
 		for (size_t i = 0; i < r.lines; ++i) {
-			if (strstr(r.raw_lines[i], "IMEI"))
+			if (strstr(r.line[i].s, "IMEI"))
 				syslog(LOG_NOTICE, "<IMEI censored by udiald>");
 			else
-				syslog(LOG_NOTICE, "%s", r.raw_lines[i]);
+				syslog(LOG_NOTICE, "%s", r.line[i].s);
 		}
 	}
 }
@@ -477,14 +584,12 @@ static void udiald_probe(struct udiald_state *state) {
  * Query the modem for its SIM status.
  */
 static void udiald_check_sim(struct udiald_state *state) {
-	struct udiald_tty_read r;
+	const struct udiald_tty_query *q = &startup_queries[UDIALD_Q_CPIN];
+	const char *result_line = q->reply;
 	// Getting SIM state
-	tcflush(state->ctlfd, TCIFLUSH);
-	if (udiald_tty_put(state->ctlfd, "AT+CPIN?\r") < 1
-	|| udiald_tty_get(state->ctlfd, &r, "+CPIN: ", 2500) != UDIALD_AT_OK
-	|| r.result_line == NULL) {
-		syslog(LOG_CRIT, "%s: Unable to get SIM status (%s)", state->modem.device_id, udiald_tty_flatten_result(&r));
-		udiald_config_set(state, "sim_state", "error");
+	if (q->res != UDIALD_AT_OK || strncmp(result_line, q->prefix, strlen(q->prefix))) {
+		syslog(LOG_CRIT, "%s: Unable to get SIM status (%s)", state->modem.device_id, q->reply);
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "error");
 		state->sim_state = -1;
 		if (state->app != UDIALD_APP_PROBE)
 			udiald_exitcode(UDIALD_ESIM, "Unable to get SIM status");
@@ -492,25 +597,25 @@ static void udiald_check_sim(struct udiald_state *state) {
 	}
 
 	// Evaluate SIM state
-	if (!strcmp(r.result_line, "+CPIN: READY")) {
+	if (!strcmp(result_line, "+CPIN: READY")) {
 		syslog(LOG_NOTICE, "%s: SIM card is ready", state->modem.device_id);
-		udiald_config_set(state, "sim_state", "ready");
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "ready");
 		state->sim_state = 0;
-	} else if (!strcmp(r.result_line, "+CPIN: SIM PIN")) {
+	} else if (!strcmp(result_line, "+CPIN: SIM PIN")) {
 		syslog(LOG_NOTICE, "%s: SIM card requires pin", state->modem.device_id);
-		udiald_config_set(state, "sim_state", "wantpin");
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "wantpin");
 		state->sim_state = 1;
-	} else if (!strcmp(r.result_line, "+CPIN: SIM PUK")) {
+	} else if (!strcmp(result_line, "+CPIN: SIM PUK")) {
 		syslog(LOG_WARNING, "%s: SIM requires PUK!", state->modem.device_id);
-		udiald_config_set(state, "sim_state", "wantpuk");
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "wantpuk");
 		state->sim_state = 2;
 	} else {
-		udiald_config_set(state, "sim_state", "error");
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "error");
 		state->sim_state = -1;
 		if (state->app != UDIALD_APP_PROBE)
-			udiald_exitcode(UDIALD_ESIM, "Unknown SIM status (%s)", r.result_line);
+			udiald_exitcode(UDIALD_ESIM, "Unknown SIM status (%s)", result_line);
 		else
-			syslog(LOG_CRIT, "%s: Unknown SIM status (%s)", state->modem.device_id, r.result_line);
+			syslog(LOG_CRIT, "%s: Unknown SIM status (%s)", state->modem.device_id, result_line);
 	}
 }
 
@@ -535,12 +640,12 @@ static void udiald_enter_puk(struct udiald_state *state, const char *puk, const
 	snprintf(b, sizeof(b), "AT+CPIN=\"%s\",\"%s\"\r", puk, pin);
 
 	// Send command
-	struct udiald_tty_read r;
-	tcflush(state->ctlfd, TCIFLUSH);
+	struct udiald_tty_read r = {0};
+	udiald_tty_drain(state->ctlfd);
 	if (udiald_tty_put(state->ctlfd, b) >= 0
 	&& udiald_tty_get(state->ctlfd, &r, NULL, 2500) == UDIALD_AT_OK) {
 		syslog(LOG_NOTICE, "%s: PIN reset successful", state->modem.device_id);
-		udiald_config_set(state, "sim_state", "ready");
+		udiald_var_set(state, UDIALD_VAR_SIM_STATE, "ready");
 		udiald_exitcode(UDIALD_OK, NULL);
 	} else {
 		udiald_exitcode(UDIALD_EUNLOCK, "Failed to reset PIN");
@@ -590,8 +695,8 @@ static void udiald_enter_pin(struct udiald_state *state) {
 	snprintf(b, sizeof(b), "AT+CPIN=\"%s\"\r", pin);
 
 	// Send command
-	struct udiald_tty_read r;
-	tcflush(state->ctlfd, TCIFLUSH);
+	struct udiald_tty_read r = {0};
+	udiald_tty_drain(state->ctlfd);
 	if (udiald_tty_put(state->ctlfd, b) < 0
 	|| udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK) {
 		ucix_add_option(state->uci, state->uciname, UCI_SECTION_GLOBAL, "failed_pin", pin);
@@ -605,62 +710,134 @@ static void udiald_enter_pin(struct udiald_state *state) {
 	free(pin);
 
 	syslog(LOG_NOTICE, "%s: PIN accepted", state->modem.device_id);
-	udiald_config_set(state, "sim_state", "ready");
+	udiald_var_set(state, UDIALD_VAR_SIM_STATE, "ready");
 
-	// Wait a few seconds for the dongle to find a carrier.
+	// Wait (at most a few seconds) for the dongle to find a carrier.
 	// Some dongles apparently do not send a NO CARRIER reply to the
 	// dialing, but instead hang up directly after sending a CONNECT
-	// reply (Alcatel X060S / 1bbb:0000 showed this problem).
-	sleep_seconds(5);
+	// reply (Alcatel X060S / 1bbb:0000 showed this problem). Modems
+	// that cannot report their registration get the full wait.
+	const unsigned int timeout = 5000;
+	uint64_t start = udiald_util_monotonic_ms();
+	if (udiald_reg_wait(state->ctlfd, state->modem.profile->cfg.maxcmdlen, timeout) == 0) {
+		syslog(LOG_NOTICE, "%s: Registered to the network after %u ms", state->modem.device_id,
+			(unsigned int)(udiald_util_monotonic_ms() - start));
+	} else if (errno == ENOTSUP) {
+		uint64_t elapsed = udiald_util_monotonic_ms() - start;
+		unsigned int left = (elapsed < timeout) ? timeout - elapsed : 0;
+		const struct timespec ts = {.tv_sec = left / 1000, .tv_nsec = (left % 1000) * 1000000};
+		nanosleep(&ts, NULL);
+	} else {
+		syslog(LOG_NOTICE, "%s: Not registered to the network yet, continuing anyway", state->modem.device_id);
+	}
 }
 
 /**
  * Query the device for supported capabilities.
  */
 static void udiald_check_caps(struct udiald_state *state) {
-	struct udiald_tty_read r;
+	struct udiald_tty_query *q = &startup_queries[UDIALD_Q_GCAP];
 	state->is_gsm = 0;
-	if (udiald_tty_put(state->ctlfd, "AT+GCAP\r") >= 0
-	&& udiald_tty_get(state->ctlfd, &r, "+GCAP: ", 2500) == UDIALD_AT_OK
-	&& r.result_line) {
-		if (strstr(r.result_line, "CGSM")) {
+	// Some modems refuse to answer while the SIM is locked, so retry
+	// now that it might have been unlocked.
+	if (q->res != UDIALD_AT_OK)
+		udiald_tty_batch(state->ctlfd, q, 1, 0, 2500);
+
+	if (q->res == UDIALD_AT_OK
+	&& !strncmp(q->reply, q->prefix, strlen(q->prefix))) {
+		if (strstr(q->reply, "CGSM")) {
 			state->is_gsm = 1;
-			udiald_config_set(state, "modem_gsm", "1");
+			udiald_var_set(state, UDIALD_VAR_MODEM_GSM, "1");
 			syslog(LOG_NOTICE, "%s: Detected a GSM modem", state->modem.device_id);
 		}
 	}
 }
 
+/**
+ * Read back the setting changed by the given set command (e.g. using
+ * AT^SYSCFG? for AT^SYSCFG=...) into buf.
+ *
+ * Returns false when the command has no read form or reading fails.
+ */
+static bool udiald_read_setting(struct udiald_state *state, const char *setcmd, char *buf, size_t len) {
+	struct udiald_tty_read r = {0};
+	char cmd[64];
+	const char *eq = strchr(setcmd, '=');
+	if (!eq || (size_t)(eq - setcmd) + 3 > sizeof(cmd))
+		return false;
+	snprintf(cmd, sizeof(cmd), "%.*s?\r", (int)(eq - setcmd), setcmd);
+
+	udiald_tty_drain(state->ctlfd);
+	if (udiald_tty_put(state->ctlfd, cmd) < 0
+	|| udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK || !r.lines)
+		return false;
+	snprintf(buf, len, "%s", udiald_tty_flatten_result(&r));
+	return true;
+}
+
 /**
  * Set the device mode (GPRS/UMTS).
  *
  * The mode to set is taken from the configuration.
  */
 static void udiald_set_mode(struct udiald_state *state) {
-	struct udiald_tty_read r;
+	struct udiald_tty_read r = {0};
 	char *m = udiald_config_get(state, "udiald_mode");
 	enum udiald_mode mode = udiald_modem_modeval((m && *m) ? m : "auto");
 	if (mode == -1 || !state->modem.profile->cfg.modecmd[mode]) {
 		free(m);
 		udiald_exitcode(UDIALD_EINVAL, "Unsupported mode (%s)", udiald_modem_modestr(mode));
 	}
-	tcflush(state->ctlfd, TCIFLUSH);
-	if (state->modem.profile->cfg.modecmd[mode][0]
-	&& (udiald_tty_put(state->ctlfd, state->modem.profile->cfg.modecmd[mode]) < 0
-	|| udiald_tty_get(state->ctlfd, &r, NULL, 5000) != UDIALD_AT_OK)) {
-		free(m);
+	free(m);
+
+	const char *cmd = state->modem.profile->cfg.modecmd[mode];
+	if (!cmd[0]) {
+		syslog(LOG_NOTICE, "%s: Mode set to %s", state->modem.device_id, udiald_modem_modestr(mode));
+		return;
+	}
+
+	// Some modems (e.g. Huawei sticks with AT^SYSCFG) drop their
+	// registration when the mode is set again, even when it does not
+	// change. So when an earlier run set the same mode on this modem
+	// and the modem still reports the setting it had then, leave it.
+	char value[320], *cached = udiald_cache_get(state, "mode");
+	size_t namelen = strlen(udiald_modem_modestr(mode));
+	bool unchanged = cached && !strncmp(cached, udiald_modem_modestr(mode), namelen)
+		&& cached[namelen] == ' '
+		&& udiald_read_setting(state, cmd, value, sizeof(value))
+		&& !strcmp(cached + namelen + 1, value);
+	free(cached);
+	if (unchanged) {
+		syslog(LOG_NOTICE, "%s: Mode already set to %s", state->modem.device_id, udiald_modem_modestr(mode));
+		return;
+	}
+
+	udiald_tty_drain(state->ctlfd);
+	if (udiald_tty_put(state->ctlfd, cmd) < 0
+	|| udiald_tty_get(state->ctlfd, &r, NULL, 5000) != UDIALD_AT_OK) {
+		udiald_cache_set(state, "mode", NULL);
 		udiald_exitcode(UDIALD_EMODEM, "Failed to set mode %s (%s)",
 			state->modem.device_id, udiald_modem_modestr(mode), udiald_tty_flatten_result(&r));
 	}
 	syslog(LOG_NOTICE, "%s: Mode set to %s", state->modem.device_id, udiald_modem_modestr(mode));
-	free(m);
+
+	// Remember what the modem reports now, for the next run
+	int n = snprintf(value, sizeof(value), "%s ", udiald_modem_modestr(mode));
+	if (udiald_read_setting(state, cmd, value + n, sizeof(value) - n))
+		udiald_cache_set(state, "mode", value);
+	else
+		udiald_cache_set(state, "mode", NULL);
+}
+
+static void udiald_signal_check_timer(struct uloop_timeout *t) {
+	// A signal might have arrived before uloop_run started
+	if (signaled)
+		uloop_end();
 }
 
 static void udiald_connect_status_mainloop(struct udiald_state *state) {
-	int status = -1;
-	int logsteps = 4;	// Report RSSI / BER to syslog every LOGSTEPS intervals
-	char provider[64] = {0};
-	struct udiald_tty_read r;
+	struct udiald_tty_read r = {0};
+	struct uloop_timeout check = {.cb = udiald_signal_check_timer};
 
 	// Set reporting format for AT+COPS? to 0 (long alphanumeric
 	// format), for devices that default to reporting numeric
@@ -670,93 +847,269 @@ static void udiald_connect_status_mainloop(struct udiald_state *state) {
 	if (udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK)
 		syslog(LOG_WARNING, "%s: Failed to set AT+COPS to long format\n", state->modem.device_id);
 
-	// Main loop, wait for termination, measure signal strength
-	while (!signaled) {
-		// First run
-		if (!++status) {
-			udiald_config_set(state, "connected", "1");
-			ucix_save(state->uci, state->uciname);
-		} else {
-			sleep_seconds(15);
-			if (signaled) break;
-		}
-
-		// Query provider and RSSI / BER
-		tcflush(state->ctlfd, TCIFLUSH);
-/*		udiald_tty_put(state->ctlfd, "AT+CREG?\r");
-		udiald_tty_get(state->ctlfd, b, sizeof(b), 2500);
-		printf("%s:%s[%d]%s\n", __FILE__, __func__, __LINE__, b);
-*/
-		udiald_tty_put(state->ctlfd, "AT+COPS?;+CSQ\r");
-		if (udiald_tty_get(state->ctlfd, &r, NULL, 2500) != UDIALD_AT_OK
-		|| r.lines < 3)
-			continue;
+	udiald_var_set(state, UDIALD_VAR_CONNECTED, "1");
+	udiald_var_commit(state);
+
+	// Main loop, wait for termination, keep track of the link status.
+	// This ends when a signal is received (including SIGCHLD from pppd
+	// or the DHCP client), or when the modem drops an NCM connection.
+	uloop_init();
+	if (udiald_at_channel_init(&atchan, state->ctlfd))
+		udiald_exitcode(UDIALD_EINTERNAL, "Failed to set up control channel");
+	udiald_status_start(state, &atchan);
+	udiald_traffic_start(state, &atchan);
+	udiald_signal_start(state, &atchan);
+	udiald_history_start(state);
+	udiald_ubus_attach();
+	uloop_timeout_set(&check, 0);
+	uloop_run();
+
+	udiald_ubus_detach();
+	udiald_history_stop();
+	udiald_signal_stop();
+	udiald_traffic_stop();
+	udiald_status_stop();
+	udiald_at_channel_close(&atchan);
+	uloop_timeout_cancel(&check);
+	uloop_done();
+	syslog(LOG_NOTICE, "Received signal %d, disconnecting", signaled);
+}
 
-		char *saveptr;
-		char *cops = r.raw_lines[0];
-		char *csq = r.raw_lines[1];
-
-		if (cops && (cops = strchr(cops, '"')) // +COPS: 0,0,"FONIC",2
-		&& (cops = strtok_r(cops, "\"", &saveptr))
-		&& strncmp(cops, provider, sizeof(provider) - 1)) {
-			syslog(LOG_NOTICE, "%s: Provider is %s",
-				state->modem.device_id, cops);
-			udiald_config_revert(state, "provider");
-			udiald_config_set(state, "provider", cops);
-			strncpy(provider, cops, sizeof(provider) - 1);
+/**
+ * Start a session. On the PPP data path, this starts pppd. With the
+ * udiald_inprocess_dial option, first dial on the data tty ourselves
+ * and hand the connected tty to pppd, instead of having pppd run
+ * udiald again as its connect script.
+ *
+ * Returns UDIALD_OK, or an error code with a description in *msg.
+ */
+static int udiald_session_start(struct udiald_state *state, const char **msg) {
+	if (state->modem.profile->cfg.datapath == UDIALD_DATAPATH_NCM)
+		return udiald_ncm_start(state, msg);
+
+	int datfd = -1;
+	if (udiald_config_get_int(state, "udiald_inprocess_dial", 0)) {
+		char ttypath[PATH_MAX];
+		snprintf(ttypath, sizeof(ttypath), "%s/dev/%s", state->sysroot, state->modem.dat_tty);
+		if ((datfd = udiald_tty_cloexec(udiald_tty_open(ttypath))) == -1) {
+			*msg = "Unable to open data terminal";
+			return UDIALD_EMODEM;
 		}
-
-		if (csq && (csq = strtok_r(csq, " ,", &saveptr))
-		&& (csq = strtok_r(NULL, " ,", &saveptr))) {	// +CSQ: 14,99
-			// RSSI
-			udiald_config_revert(state, "rssi");
-			udiald_config_set(state, "rssi", csq);
-			if ((status % logsteps) == 0)
-				syslog(LOG_NOTICE, "%s: RSSI is %s",
-					state->modem.device_id, csq);
+		if (udiald_dial(state, datfd, state->modem.dat_tty) != UDIALD_OK) {
+			udiald_tty_close(datfd);
+			*msg = "Dialing failed";
+			return UDIALD_EDIAL;
 		}
-		ucix_save(state->uci, state->uciname);
 	}
-	syslog(LOG_NOTICE, "Received signal %d, disconnecting", signaled);
+
+	char snapshot[512];
+	bool snap = udiald_modem_snapshot(&state->modem, snapshot, sizeof(snapshot)) == UDIALD_OK;
+	state->pppd = udiald_tty_pppd(state, datfd, snap ? snapshot : NULL);
+	// pppd has its own copy now
+	if (datfd != -1)
+		udiald_tty_close(datfd);
+	else
+		// The dialer that pppd starts sets udiald_state
+		udiald_var_forget(state, UDIALD_VAR_STATE);
+	if (!state->pppd) {
+		*msg = "pppd: Failed to start";
+		return UDIALD_EINTERNAL;
+	}
+	return UDIALD_OK;
 }
 
-static void udiald_connect_finish(struct udiald_state *state) {
-	udiald_config_revert(state, "pid");
-	udiald_config_revert(state, "connected");
-	udiald_config_revert(state, "provider");
-	udiald_config_revert(state, "rssi");
+/**
+ * End the current session: clean up the connection state, hang up
+ * using the given command and stop pppd when it is still running. The
+ * NCM data path disconnects with its own command instead.
+ *
+ * Returns the error code for how the session ended, with a description
+ * in *msg.
+ */
+static int udiald_session_end(struct udiald_state *state, const char *hangup, const char **msg) {
+	static char buf[64];
+
+	udiald_var_unset(state, UDIALD_VAR_PID);
+	udiald_var_unset(state, UDIALD_VAR_CONNECTED);
+	udiald_var_unset(state, UDIALD_VAR_PROVIDER);
+	udiald_var_unset(state, UDIALD_VAR_RSSI);
+	udiald_var_unset(state, UDIALD_VAR_BER);
+	udiald_var_unset(state, UDIALD_VAR_RAT);
+	udiald_var_unset(state, UDIALD_VAR_REGISTRATION);
+	for (int i = UDIALD_VAR_RX_BYTES; i <= UDIALD_VAR_SIGNAL_SINR; ++i)
+		udiald_var_unset(state, i);
+
+	if (state->modem.profile->cfg.datapath == UDIALD_DATAPATH_NCM) {
+		int code = udiald_ncm_stop(state, msg);
+		if (code == UDIALD_ESIGNALED) {
+			snprintf(buf, sizeof(buf), "Terminated by signal %i", signaled);
+			*msg = buf;
+		}
+		return code;
+	}
 
-	// Terminate active connection by hanging up and resetting
-	udiald_tty_put(state->ctlfd, "ATH;&F\r");
+	// Terminate active connection by hanging up
+	udiald_tty_put(state->ctlfd, hangup);
 	int status;
 	if (waitpid(state->pppd, &status, WNOHANG) != state->pppd) {
 		kill(state->pppd, SIGTERM);
 		waitpid(state->pppd, &status, 0);
-		udiald_exitcode(UDIALD_ESIGNALED, "Terminated by signal %i", signaled);
+		snprintf(buf, sizeof(buf), "Terminated by signal %i", signaled);
+		*msg = buf;
+		return UDIALD_ESIGNALED;
 	}
 
 	if (WIFSIGNALED(status) || WEXITSTATUS(status) == 5) {
 		// pppd was termined externally, we won't treat this as an error
-		udiald_exitcode(UDIALD_ESIGNALED, "pppd terminated");
+		*msg = "pppd terminated";
+		return UDIALD_ESIGNALED;
 	}
 
 	switch (WEXITSTATUS(status)) {	// Exit codes from pppd (man pppd)
 		case 7:
 		case 16:
-			udiald_exitcode(UDIALD_EMODEM, "pppd: modem error");
+			*msg = "pppd: modem error";
+			return UDIALD_EMODEM;
 
 		case 8:
-			udiald_exitcode(UDIALD_EDIAL, "pppd: dialing error");
+			*msg = "pppd: dialing error";
+			return UDIALD_EDIAL;
 
 		case 0:
 		case 15:
-			udiald_exitcode(UDIALD_ENETWORK, "ppd: terminated by network");
+			*msg = "ppd: terminated by network";
+			return UDIALD_ENETWORK;
 
 		case 19:
-			udiald_exitcode(UDIALD_EAUTH, "pppd: invalid credentials");
+			*msg = "pppd: invalid credentials";
+			return UDIALD_EAUTH;
 
 		default:
-			udiald_exitcode(UDIALD_EPPP, "pppd: other error (%i)", WEXITSTATUS(status));
+			snprintf(buf, sizeof(buf), "pppd: other error (%i)", WEXITSTATUS(status));
+			*msg = buf;
+			return UDIALD_EPPP;
+	}
+}
+
+static void udiald_connect_finish(struct udiald_state *state) {
+	const char *msg;
+	// Hang up and reset
+	int code = udiald_session_end(state, "ATH;&F\r", &msg);
+	udiald_exitcode(code, "%s", msg);
+}
+
+// Reconnect no sooner than this (in ms) after the previous session
+// started, when it ended by itself
+#define UDIALD_RESIDENT_HOLDOFF 5000
+
+static void udiald_standby_timer(struct uloop_timeout *t) {
+	// A signal might have arrived before uloop_run started
+	if (signaled || connect_requested)
+		uloop_end();
+}
+
+/**
+ * Wait between sessions in resident mode, until a connect is requested
+ * or a signal arrives. The control channel stays open, so URCs are
+ * still handled.
+ */
+static void udiald_resident_standby(struct udiald_state *state) {
+	struct uloop_timeout check = {.cb = udiald_standby_timer};
+
+	udiald_var_set(state, UDIALD_VAR_STATE, "standby");
+	udiald_var_set_int(state, UDIALD_VAR_PID, getpid());
+	udiald_var_commit(state);
+	syslog(LOG_NOTICE, "%s: Standing by (send SIGUSR2 to connect)", state->modem.device_id);
+
+	uloop_init();
+	if (udiald_at_channel_init(&atchan, state->ctlfd))
+		udiald_exitcode(UDIALD_EINTERNAL, "Failed to set up control channel");
+	udiald_history_start(state);
+	udiald_ubus_attach();
+	standby = 1;
+	while (!connect_requested && signaled != SIGTERM && signaled != SIGINT) {
+		// Disconnect requests don't mean anything here
+		signaled = 0;
+		udiald_tty_interrupted = 0;
+		uloop_timeout_set(&check, 0);
+		uloop_run();
+	}
+	standby = 0;
+	udiald_ubus_detach();
+	udiald_history_stop();
+	udiald_at_channel_close(&atchan);
+	uloop_timeout_cancel(&check);
+	uloop_done();
+}
+
+/**
+ * Resident mode: run sessions until terminated, keeping the control
+ * tty open and the modem set up (SIM unlocked, mode set) in between.
+ *
+ * SIGHUP ends the current session and waits for SIGUSR2 to start the
+ * next one. When a session ends by itself (e.g. the network dropped
+ * the connection), the next one is started right away. Errors that
+ * need the modem to be set up again (modem errors) or user action
+ * (authentication) end the process like they do without this mode.
+ * Never returns.
+ */
+static void udiald_resident_main(struct udiald_state *state) {
+	// Connect right away when started
+	connect_requested = 1;
+	while (true) {
+		if (!connect_requested)
+			udiald_resident_standby(state);
+		if (signaled == SIGTERM || signaled == SIGINT)
+			udiald_exitcode(UDIALD_ESIGNALED, "Terminated by signal %i", signaled);
+		connect_requested = 0;
+		signaled = 0;
+		udiald_tty_interrupted = 0;
+
+		udiald_var_set(state, UDIALD_VAR_STATE, "dial");
+		udiald_var_set_int(state, UDIALD_VAR_PID, getpid());
+		udiald_var_commit(state);
+
+		uint64_t start = udiald_util_monotonic_ms();
+		const char *msg;
+		int code = udiald_session_start(state, &msg);
+		int sig = signaled;
+		if (code == UDIALD_OK) {
+			udiald_connect_status_mainloop(state);
+			sig = signaled;
+			code = udiald_session_end(state, "ATH\r", &msg);
+		}
+		if (sig == SIGTERM || sig == SIGINT)
+			udiald_exitcode(UDIALD_ESIGNALED, "Terminated by signal %i", sig);
+		if (code == UDIALD_EMODEM || code == UDIALD_EAUTH || code == UDIALD_EINTERNAL)
+			udiald_exitcode(code, "%s", msg);
+
+		if (sig == SIGHUP) {
+			syslog(LOG_NOTICE, "%s: Disconnected on request", state->modem.device_id);
+			continue;
+		}
+
+		// The session ended by itself, so try again. Don't hammer
+		// the network when it keeps failing right away. Forget how
+		// it ended (e.g. SIGCHLD), so a disconnect request that
+		// comes in meanwhile is not lost.
+		signaled = 0;
+		syslog(LOG_NOTICE, "%s: Connection ended (%s), reconnecting", state->modem.device_id, msg);
+		udiald_var_set_int(state, UDIALD_VAR_ERROR_CODE, code);
+		udiald_var_set(state, UDIALD_VAR_ERROR_MSG, msg);
+		uint64_t elapsed = udiald_util_monotonic_ms() - start;
+		if (elapsed < UDIALD_RESIDENT_HOLDOFF) {
+			unsigned int left = UDIALD_RESIDENT_HOLDOFF - elapsed;
+			const struct timespec ts = {.tv_sec = left / 1000, .tv_nsec = (left % 1000) * 1000000};
+			nanosleep(&ts, NULL);
+		}
+		// Signals that arrived meanwhile still count
+		if (signaled == SIGTERM || signaled == SIGINT)
+			udiald_exitcode(UDIALD_ESIGNALED, "Terminated by signal %i", signaled);
+		if (signaled == SIGHUP) {
+			syslog(LOG_NOTICE, "%s: Disconnected on request", state->modem.device_id);
+			continue;
+		}
+		connect_requested = 1;
 	}
 }
 
@@ -769,8 +1122,7 @@ int main(int argc, char *const argv[]) {
 
 	udiald_setup_uci(&state);
 
-	/* Load additional profiles from uci */
-	udiald_modem_load_profiles(&state);
+	udiald_setup_trace(&state);
 
 	atexit(udiald_cleanup);
 
@@ -779,6 +1131,10 @@ int main(int argc, char *const argv[]) {
 		.sa_handler = SIG_IGN,
 	};
 	sigaction(SIGPIPE, &sa, NULL);
+	sa.sa_handler = udiald_dump_trace;
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = udiald_request_connect;
+	sigaction(SIGUSR2, &sa, NULL);
 	sa.sa_handler = udiald_cleanup_safe;
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
@@ -788,6 +1144,9 @@ int main(int argc, char *const argv[]) {
 	if (state.app == UDIALD_APP_DIAL)
 		return udiald_dial_main(&state);
 
+	/* Load additional profiles from uci */
+	udiald_modem_load_profiles(&state);
+
 	if (state.app == UDIALD_APP_LIST_PROFILES)
 		return udiald_modem_list_profiles(&state);
 
@@ -803,18 +1162,20 @@ int main(int argc, char *const argv[]) {
 	}
 
 	// Reset state
-	udiald_config_revert(&state, "modem_name");
-	udiald_config_revert(&state, "modem_driver");
-	udiald_config_revert(&state, "modem_id");
+	udiald_var_unset(&state, UDIALD_VAR_MODEM_NAME);
+	udiald_var_unset(&state, UDIALD_VAR_MODEM_DRIVER);
+	udiald_var_unset(&state, UDIALD_VAR_MODEM_ID);
 	udiald_config_revert(&state, "modem_mode");
-	udiald_config_revert(&state, "modem_gsm");
-	udiald_config_revert(&state, "sim_state");
-	udiald_config_revert(&state, "udiald_error_code");
-	udiald_config_revert(&state, "udiald_error_msg");
+	udiald_var_unset(&state, UDIALD_VAR_MODEM_GSM);
+	udiald_var_unset(&state, UDIALD_VAR_SIM_STATE);
+	udiald_var_unset(&state, UDIALD_VAR_ERROR_CODE);
+	udiald_var_unset(&state, UDIALD_VAR_ERROR_MSG);
 
 	if (state.app == UDIALD_APP_CONNECT) {
-		udiald_config_set(&state, "udiald_state", "init");
-		ucix_save(state.uci, state.uciname);
+		udiald_shm_open(&state);
+		udiald_ubus_init(&state);
+		udiald_var_set(&state, UDIALD_VAR_STATE, "init");
+		udiald_var_commit(&state);
 	}
 
 	udiald_select_modem(&state);
@@ -823,6 +1184,8 @@ int main(int argc, char *const argv[]) {
 
 	udiald_modem_reset(&state);
 
+	udiald_query_modem(&state);
+
 	udiald_identify(&state);
 
 	udiald_check_sim(&state);
@@ -870,8 +1233,8 @@ int main(int argc, char *const argv[]) {
 	}
 
 	// Save state
-	udiald_config_set_int(&state, "pid", getpid());
-	ucix_save(state.uci, state.uciname);
+	udiald_var_set_int(&state, UDIALD_VAR_PID, getpid());
+	udiald_var_commit(&state);
 
 	// Block and unbind signals so they won't interfere
 	sa.sa_handler = udiald_catch_signal;
@@ -880,14 +1243,19 @@ int main(int argc, char *const argv[]) {
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGCHLD, &sa, NULL);
 
+	if (state.app == UDIALD_APP_CONNECT && state.flags & UDIALD_FLAG_RESIDENT)
+		udiald_resident_main(&state); // Never returns
+
 	if (state.app == UDIALD_APP_CONNECT) {
-		udiald_config_set(&state, "udiald_state", "dial");
-		ucix_save(state.uci, state.uciname);
+		udiald_var_set(&state, UDIALD_VAR_STATE, "dial");
+		udiald_var_commit(&state);
 	}
 
-	// Start pppd to dial
-	if (!(state.pppd = udiald_tty_pppd(&state)))
-		udiald_exitcode(UDIALD_EINTERNAL, "pppd: Failed to start");
+	// Start pppd to dial, or connect on the NCM data path
+	const char *msg;
+	int code = udiald_session_start(&state, &msg);
+	if (code != UDIALD_OK)
+		udiald_exitcode(code, "%s", msg);
 
 	udiald_connect_status_mainloop(&state);
 
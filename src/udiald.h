@@ -9,9 +9,11 @@
 #define UDIALD_H_
 
 #include <libubox/list.h>
+#include <libubox/uloop.h>
 #include <sys/types.h>
 #include <stdint.h>
 #include <errno.h>
+#include <signal.h>
 #include <glob.h>
 #include <json/json.h>
 #include "ucix.h"
@@ -19,6 +21,10 @@
 #define UDIALD_FLAG_TESTSTATE	0x01
 #define UDIALD_FLAG_NOERRSTAT	0x02
 #define UDIALD_FLAG_SIGNALED	0x04
+#define UDIALD_FLAG_RESIDENT	0x08
+
+// Environment variable passing the selected modem to the dialer
+#define UDIALD_SNAPSHOT_ENV	"UDIALD_SNAPSHOT"
 
 #define lengthof(x) (sizeof(x) / sizeof(*x))
 
@@ -46,6 +52,21 @@ enum udiald_mode {
 	UDIALD_NUM_MODES /* This must always be the last entry. */
 };
 
+// How a connection carries data
+enum udiald_datapath {
+	UDIALD_DATAPATH_PPP, /* PPP on the data tty, run by pppd */
+	UDIALD_DATAPATH_NCM, /* Huawei NCM network interface, started with AT^NDISDUP */
+};
+
+// Commands to query the signal quality with, see signal.c
+enum udiald_signal_query {
+	UDIALD_SIGNAL_CESQ = 1 << 0, /* AT+CESQ (27.007) */
+	UDIALD_SIGNAL_HCSQ = 1 << 1, /* Huawei AT^HCSQ? */
+	UDIALD_SIGNAL_CSNR = 1 << 2, /* Huawei AT^CSNR? */
+	UDIALD_SIGNAL_ZRSSI = 1 << 3, /* ZTE AT+ZRSSI */
+	UDIALD_SIGNAL_GSTATUS = 1 << 4, /* Sierra AT!GSTATUS? */
+};
+
 enum udiald_atres {
 	UDIALD_FAIL = -1,
 	UDIALD_AT_OK,
@@ -56,6 +77,9 @@ enum udiald_atres {
 	UDIALD_AT_BUSY,
 	UDIALD_AT_NOCARRIER,
 	UDIALD_AT_NOT_SUPPORTED,
+	UDIALD_AT_CMSERROR,
+	UDIALD_AT_NOANSWER,
+	UDIALD_AT_ABORTED,
 };
 
 struct udiald_config {
@@ -63,6 +87,9 @@ struct udiald_config {
 	uint8_t datidx;		/* Index of data TTY from first TTY */
 	char *modecmd[UDIALD_NUM_MODES];	/* Commands to enter modes */
 	char *dialcmd; /* Dial command */
+	size_t maxcmdlen; /* Longest command line the modem accepts (0 for default) */
+	enum udiald_datapath datapath; /* How data is carried (PPP unless set) */
+	unsigned int signal; /* Signal quality queries, see enum udiald_signal_query (0 for the vendor default) */
 };
 
 enum udiald_profile_flags {
@@ -141,6 +168,56 @@ enum udiald_display_format {
 	UDIALD_FORMAT_ID,
 };
 
+/* Values udiald publishes in the uci state (except for the traffic and
+ * signal values), the status file and ubus, see var.c */
+enum udiald_var_id {
+	UDIALD_VAR_STATE,
+	UDIALD_VAR_PID,
+	UDIALD_VAR_CONNECTED,
+	UDIALD_VAR_PROVIDER,
+	UDIALD_VAR_RSSI,
+	UDIALD_VAR_BER,
+	UDIALD_VAR_RAT,
+	UDIALD_VAR_REGISTRATION,
+	UDIALD_VAR_MODEM_NAME,
+	UDIALD_VAR_MODEM_ID,
+	UDIALD_VAR_MODEM_DRIVER,
+	UDIALD_VAR_MODEM_GSM,
+	UDIALD_VAR_SIM_STATE,
+	UDIALD_VAR_ERROR_CODE,
+	UDIALD_VAR_ERROR_MSG,
+	// Interface counters, in the order of counter_file in traffic.c
+	UDIALD_VAR_RX_BYTES,
+	UDIALD_VAR_TX_BYTES,
+	UDIALD_VAR_RX_PACKETS,
+	UDIALD_VAR_TX_PACKETS,
+	UDIALD_VAR_RX_ERRORS,
+	UDIALD_VAR_TX_ERRORS,
+	UDIALD_VAR_RX_DROPPED,
+	UDIALD_VAR_TX_DROPPED,
+	UDIALD_VAR_RX_RATE,
+	UDIALD_VAR_TX_RATE,
+	UDIALD_VAR_MODEM_RX_BYTES,
+	UDIALD_VAR_MODEM_TX_BYTES,
+	// Signal quality in dBm or dB, in the order of enum
+	// udiald_signal_value in signal.c
+	UDIALD_VAR_SIGNAL_RSSI,
+	UDIALD_VAR_SIGNAL_RSCP,
+	UDIALD_VAR_SIGNAL_ECIO,
+	UDIALD_VAR_SIGNAL_RSRP,
+	UDIALD_VAR_SIGNAL_RSRQ,
+	UDIALD_VAR_SIGNAL_SINR,
+	UDIALD_NUM_VARS /* This must always be the last entry. */
+};
+
+/* In-memory copy of a value in the uci state */
+struct udiald_var {
+	char value[256];
+	bool set; /* Has a value, rather than being absent */
+	bool known; /* The uci state is known to match, unless dirty */
+	bool dirty; /* Changed since it was last written (or published) */
+};
+
 /* Current umts state */
 struct udiald_state {
 	int ctlfd;
@@ -153,45 +230,220 @@ struct udiald_state {
 	char uciname[32]; /*< The name of the uci config file to use */
 	char networkname[32]; /*< The name of the uci section to use */
 	char *pin; /*< PIN passed on the commandline, if any */
-	pid_t pppd;
+	const char *sysroot; /*< Prefix for /sys, /dev, uci and pppd paths ("" for none) */
+	pid_t pppd; /*< pppd, or the DHCP client on the NCM data path */
 	struct list_head custom_profiles; /* Custom profiles loaded from uci */
 	enum udiald_app app;
 	enum udiald_display_format format;
+	struct udiald_var vars[UDIALD_NUM_VARS]; /* Values published in the uci state */
+};
+
+/* Network registration status, as reported by +CREG, +CGREG and +CEREG */
+enum udiald_reg_stat {
+	UDIALD_REG_NONE = 0, /* Not registered, not searching */
+	UDIALD_REG_HOME = 1, /* Registered to the home network */
+	UDIALD_REG_SEARCHING = 2, /* Not registered, searching */
+	UDIALD_REG_DENIED = 3, /* Registration denied */
+	UDIALD_REG_UNKNOWN = 4,
+	UDIALD_REG_ROAMING = 5, /* Registered, roaming */
+	UDIALD_REG_MAX = 11, /* Highest value defined by 27.007 */
+};
+
+/* Direction of a chunk of data in the wire trace */
+enum udiald_trace_dir {
+	UDIALD_TRACE_TX, /* Written to the modem */
+	UDIALD_TRACE_RX, /* Read from the modem */
+};
+
+/* A single line of a reply, pointing into the tty input buffer */
+struct udiald_tty_line {
+	// The line contents, nul-terminated
+	char *s;
+	// Length of the line, excluding the nul-termination
+	size_t len;
 };
 
 /* Result struct for udiald_tty_get */
 struct udiald_tty_read {
 	// Number of lines read
 	size_t lines;
-	// Lines read
-	char *raw_lines[10];
+	// Lines read. These are owned by the tty layer and valid until
+	// the next udiald_tty_get call for the same fd.
+	struct udiald_tty_line *line;
 	// First line starting with the given result_prefix
 	char *result_line;
+	// Time between sending the command and receiving the final
+	// result code
+	unsigned int latency_ms;
 
 	// Don't use, call udiald_tty_flatten_result instead
-	char flat_buf[512];
-	// Don't use, raw_lines above points into this buffer
-	char raw_buf[512];
+	char flat_buf[256];
+};
+
+/**
+ * A single query for udiald_tty_batch.
+ */
+struct udiald_tty_query {
+	// The command to send, without "AT" and "\r" (e.g. "+CPIN?")
+	const char *cmd;
+	// The prefix of the reply line (e.g. "+CPIN: "), or NULL for
+	// commands that reply with a single unprefixed line (e.g.
+	// "+CGMI")
+	const char *prefix;
+
+	// Final result code for this query
+	enum udiald_atres res;
+	// The (first) reply line for this query, or the error line when
+	// it failed. Empty when there was no reply.
+	char reply[128];
+};
+
+/**
+ * Handler for unsolicited result codes (URCs), which are lines the
+ * modem sends on its own accord, rather than in reply to a command.
+ * See udiald_tty_urc_subscribe.
+ */
+struct udiald_urc_handler {
+	struct list_head h;
+	// Only URCs starting with this prefix are passed (NULL for all)
+	const char *prefix;
+	void (*cb)(struct udiald_urc_handler *h, const char *line);
+};
+
+/**
+ * A command for an asynchronous AT channel, see udiald_at_submit.
+ */
+struct udiald_at_cmd {
+	struct list_head h;
+	// The complete command to send, including "AT" and "\r". Must
+	// remain valid until the callback is called.
+	const char *cmd;
+	// Passed to udiald_tty_get as result_prefix (may be NULL)
+	const char *result_prefix;
+	// Time in ms for the complete reply to arrive, counted from the
+	// moment the command is written
+	int timeout;
+	// Urgent commands are sent before any non-urgent commands that
+	// are queued
+	bool urgent;
+	// Called once the reply is complete, or the command failed or
+	// was cancelled (res is UDIALD_FAIL and errno is set). r is only
+	// valid during the call, and NULL when there is no reply at all.
+	// The callback may submit new commands.
+	void (*cb)(struct udiald_at_cmd *c, enum udiald_atres res, struct udiald_tty_read *r);
+};
+
+/**
+ * An AT command channel on a tty, driven by uloop. Commands are
+ * queued and sent one at a time, without blocking the process.
+ */
+struct udiald_at_channel {
+	struct uloop_fd fd;
+	struct uloop_timeout timeout;
+	struct list_head queue;
+	// The command currently being sent or waiting for a reply
+	struct udiald_at_cmd *cur;
+	// Bytes of cur->cmd written so far
+	size_t written;
+	// The reply to cur was cancelled, but is still coming in
+	bool cancelled;
+	// The tty failed or the channel was closed, commands fail right
+	// away
+	bool dead;
+	// A reply callback is running, don't start the next command yet
+	bool in_callback;
+	struct udiald_tty_read r;
 };
 
 extern int verbose;
+extern volatile sig_atomic_t udiald_tty_interrupted;
 
 const char* udiald_modem_modestr(enum udiald_mode mode);
 enum udiald_mode udiald_modem_modeval(const char *mode);
 int udiald_modem_find_devices(const struct udiald_state *state, struct udiald_modem *modem, void func(struct udiald_modem *, void *), void *data, struct udiald_device_filter *filter);
 int udiald_modem_list_profiles(const struct udiald_state *state);
 int udiald_modem_list_devices(const struct udiald_state *state, struct udiald_device_filter *filter);
+int udiald_modem_devices_json(const struct udiald_state *state, struct udiald_device_filter *filter, struct json_object **devices);
+struct json_object *udiald_modem_profiles_json(const struct udiald_state *state);
 int udiald_modem_load_profiles(struct udiald_state *state);
+int udiald_modem_snapshot(const struct udiald_modem *modem, char *buf, size_t len);
+int udiald_modem_restore(struct udiald_modem *modem, const char *snapshot);
 
 int udiald_tty_open(const char *tty);
 char* udiald_tty_calc(const char *basetty, uint8_t index, char buf[static 24]);
+void udiald_tty_close(int fd);
 int udiald_tty_cloexec(int fd);
 int udiald_tty_put(int fd, const char *cmd);
+void udiald_tty_drain(int fd);
+void udiald_tty_set_numeric(int fd, bool numeric);
+void udiald_tty_urc_subscribe(struct udiald_urc_handler *h);
+void udiald_tty_urc_unsubscribe(struct udiald_urc_handler *h);
+void udiald_tty_urc_dispatch(void);
 const char *udiald_tty_flatten_result(struct udiald_tty_read *r);
 enum udiald_atres udiald_tty_get(int fd, struct udiald_tty_read *r, const char *result_prefix, int timeout);
-pid_t udiald_tty_pppd(struct udiald_state *state);
+ssize_t udiald_tty_put_partial(int fd, const char *cmd, size_t off);
+int udiald_tty_reply_start(int fd, struct udiald_tty_read *r);
+enum udiald_atres udiald_tty_reply_feed(int fd, struct udiald_tty_read *r, const char *result_prefix);
+pid_t udiald_tty_pppd(struct udiald_state *state, int ttyfd, const char *snapshot);
+int udiald_tty_batch(int fd, struct udiald_tty_query *q, size_t n, size_t maxlen, int timeout);
+
+int udiald_at_channel_init(struct udiald_at_channel *ch, int fd);
+void udiald_at_channel_close(struct udiald_at_channel *ch);
+void udiald_at_submit(struct udiald_at_channel *ch, struct udiald_at_cmd *c);
+void udiald_at_cancel(struct udiald_at_channel *ch, struct udiald_at_cmd *c);
+
+char *udiald_cache_get(struct udiald_state *state, const char *what);
+void udiald_cache_set(struct udiald_state *state, const char *what, const char *value);
+
+int udiald_ncm_start(struct udiald_state *state, const char **msg);
+int udiald_ncm_stop(struct udiald_state *state, const char **msg);
+
+void udiald_status_start(struct udiald_state *state, struct udiald_at_channel *ch);
+void udiald_status_stop(void);
+
+void udiald_traffic_start(struct udiald_state *state, struct udiald_at_channel *ch);
+void udiald_traffic_stop(void);
+
+void udiald_signal_start(struct udiald_state *state, struct udiald_at_channel *ch);
+void udiald_signal_stop(void);
+
+struct blob_buf;
+void udiald_history_set_file(const char *path);
+void udiald_history_sample(struct udiald_state *state);
+void udiald_history_start(struct udiald_state *state);
+void udiald_history_stop(void);
+void udiald_history_add_blob(struct blob_buf *b);
+int udiald_history_dump(const char *path);
+
+int udiald_reg_parse(const char *line, bool urc);
+bool udiald_reg_attached(int stat);
+int udiald_reg_wait(int fd, size_t maxcmdlen, int timeout);
+
+bool udiald_var_set(struct udiald_state *state, enum udiald_var_id id, const char *val);
+bool udiald_var_set_int(struct udiald_state *state, enum udiald_var_id id, int val);
+void udiald_var_unset(struct udiald_state *state, enum udiald_var_id id);
+const char *udiald_var_get(const struct udiald_state *state, enum udiald_var_id id);
+const char *udiald_var_name(enum udiald_var_id id);
+void udiald_var_forget(struct udiald_state *state, enum udiald_var_id id);
+void udiald_var_commit(struct udiald_state *state);
+void udiald_var_flush_soon(struct udiald_state *state);
+
+void udiald_shm_open(struct udiald_state *state);
+void udiald_shm_update(struct udiald_state *state, enum udiald_var_id id);
+void udiald_shm_close(void);
+
+void udiald_ubus_init(struct udiald_state *state);
+void udiald_ubus_attach(void);
+void udiald_ubus_detach(void);
+void udiald_ubus_notify(struct udiald_state *state);
+void udiald_ubus_done(void);
+
+void udiald_trace_set_file(const char *path);
+void udiald_trace_record(int fd, enum udiald_trace_dir dir, const char *data, size_t len);
+int udiald_trace_dump(const char *path);
 
 int udiald_connect_main(struct udiald_state *state);
+int udiald_dial(struct udiald_state *state, int fd, const char *tty);
 int udiald_dial_main(struct udiald_state *state);
 void udiald_select_modem(struct udiald_state *state);
 
@@ -199,6 +451,7 @@ int udiald_util_checked_glob(const char *pattern, int flags, glob_t *pglob, cons
 int udiald_util_parse_hex_word(const char *hex, uint16_t *res);
 int udiald_util_read_hex_word(const char *path, uint16_t *res);
 void udiald_util_read_symlink_basename(const char *path, char *res, size_t size);
+uint64_t udiald_util_monotonic_ms(void);
 struct json_object *udiald_util_sprintf_json_string(const char *fmt, ...);
 
 #endif /* UDIALD_H_ */
@@ -30,6 +30,7 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 
 /**
  * A version of glob that checks the return value and in case of error,
@@ -111,6 +112,17 @@ void udiald_util_read_symlink_basename(const char *path, char *res, size_t size)
 	snprintf(res, size, "%s", basename(buf));
 }
 
+/**
+ * Returns the current time in milliseconds, from a clock that is not
+ * affected by changes to the system time. Only useful for measuring
+ * intervals.
+ */
+uint64_t udiald_util_monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /*
  * Create a json_object string from a sprintf format and arguments.
  */
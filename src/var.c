@@ -0,0 +1,214 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Store for the values udiald publishes in the uci state (udiald_state,
+ * provider, rssi, ...).
+ *
+ * Values are kept in memory (in struct udiald_state) and only written
+ * to uci when they actually change. Changes are collected until
+ * udiald_var_commit, which writes them all and saves the uci state
+ * once. While connected, udiald_var_flush_soon is used instead, which
+ * saves at most once every UDIALD_VAR_FLUSH_INTERVAL.
+ *
+ * Lists and values that are only written once in a while (the cache,
+ * dial attempts, ...) still go to uci directly, they are saved by the
+ * next commit.
+ *
+ * The traffic counters and signal values change every few seconds
+ * while connected. Saving them would rewrite /var/state all the time,
+ * so they are never written to uci, only to the status file and ubus.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libubox/uloop.h>
+#include "udiald.h"
+#include "config.h"
+
+// Minimum time between two saves from udiald_var_flush_soon, in ms
+#define UDIALD_VAR_FLUSH_INTERVAL 1000
+
+// uci option names
+static const char *varname[] = {
+	[UDIALD_VAR_STATE] = "udiald_state",
+	[UDIALD_VAR_PID] = "pid",
+	[UDIALD_VAR_CONNECTED] = "connected",
+	[UDIALD_VAR_PROVIDER] = "provider",
+	[UDIALD_VAR_RSSI] = "rssi",
+	[UDIALD_VAR_BER] = "ber",
+	[UDIALD_VAR_RAT] = "rat",
+	[UDIALD_VAR_REGISTRATION] = "registration",
+	[UDIALD_VAR_MODEM_NAME] = "modem_name",
+	[UDIALD_VAR_MODEM_ID] = "modem_id",
+	[UDIALD_VAR_MODEM_DRIVER] = "modem_driver",
+	[UDIALD_VAR_MODEM_GSM] = "modem_gsm",
+	[UDIALD_VAR_SIM_STATE] = "sim_state",
+	[UDIALD_VAR_ERROR_CODE] = "udiald_error_code",
+	[UDIALD_VAR_ERROR_MSG] = "udiald_error_msg",
+	[UDIALD_VAR_RX_BYTES] = "rx_bytes",
+	[UDIALD_VAR_TX_BYTES] = "tx_bytes",
+	[UDIALD_VAR_RX_PACKETS] = "rx_packets",
+	[UDIALD_VAR_TX_PACKETS] = "tx_packets",
+	[UDIALD_VAR_RX_ERRORS] = "rx_errors",
+	[UDIALD_VAR_TX_ERRORS] = "tx_errors",
+	[UDIALD_VAR_RX_DROPPED] = "rx_dropped",
+	[UDIALD_VAR_TX_DROPPED] = "tx_dropped",
+	[UDIALD_VAR_RX_RATE] = "rx_rate",
+	[UDIALD_VAR_TX_RATE] = "tx_rate",
+	[UDIALD_VAR_MODEM_RX_BYTES] = "modem_rx_bytes",
+	[UDIALD_VAR_MODEM_TX_BYTES] = "modem_tx_bytes",
+	[UDIALD_VAR_SIGNAL_RSSI] = "signal_rssi",
+	[UDIALD_VAR_SIGNAL_RSCP] = "signal_rscp",
+	[UDIALD_VAR_SIGNAL_ECIO] = "signal_ecio",
+	[UDIALD_VAR_SIGNAL_RSRP] = "signal_rsrp",
+	[UDIALD_VAR_SIGNAL_RSRQ] = "signal_rsrq",
+	[UDIALD_VAR_SIGNAL_SINR] = "signal_sinr",
+};
+
+static void udiald_var_flush_timer(struct uloop_timeout *t);
+
+// Values that are not written to uci, see above
+static bool udiald_var_shm_only(size_t id) {
+	return (id >= UDIALD_VAR_RX_BYTES && id <= UDIALD_VAR_MODEM_TX_BYTES)
+		|| (id >= UDIALD_VAR_SIGNAL_RSSI && id <= UDIALD_VAR_SIGNAL_SINR);
+}
+
+static struct uloop_timeout flush_timer = {.cb = udiald_var_flush_timer};
+static struct udiald_state *flush_state;
+static uint64_t last_flush;
+
+/**
+ * Set a value, or remove it when val is NULL. Nothing is written until
+ * the next commit or flush.
+ *
+ * Returns true when the value changed.
+ */
+bool udiald_var_set(struct udiald_state *state, enum udiald_var_id id, const char *val) {
+	struct udiald_var *v = &state->vars[id];
+	bool same = val ? (v->set && !strncmp(v->value, val, sizeof(v->value) - 1)) : !v->set;
+	if (same && v->known)
+		return false;
+
+	v->set = (val != NULL);
+	snprintf(v->value, sizeof(v->value), "%s", val ? val : "");
+	v->known = true;
+	v->dirty = true;
+	if (!same)
+		udiald_shm_update(state, id);
+	return !same;
+}
+
+bool udiald_var_set_int(struct udiald_state *state, enum udiald_var_id id, int val) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d", val);
+	return udiald_var_set(state, id, buf);
+}
+
+void udiald_var_unset(struct udiald_state *state, enum udiald_var_id id) {
+	udiald_var_set(state, id, NULL);
+}
+
+/**
+ * Get a value, or NULL when it is not set.
+ */
+const char *udiald_var_get(const struct udiald_state *state, enum udiald_var_id id) {
+	const struct udiald_var *v = &state->vars[id];
+	return v->set ? v->value : NULL;
+}
+
+// The uci option name of a value
+const char *udiald_var_name(enum udiald_var_id id) {
+	return varname[id];
+}
+
+/**
+ * Forget what is in the uci state for a value, for when another
+ * process (e.g. the dialer) may have changed it. The next set writes
+ * it, even when it is the same as before.
+ */
+void udiald_var_forget(struct udiald_state *state, enum udiald_var_id id) {
+	state->vars[id].known = false;
+}
+
+/**
+ * Write all changed values to uci. Returns true when anything was
+ * written, changed is set when anything changed at all (including
+ * values that are not written to uci).
+ */
+static bool udiald_var_write(struct udiald_state *state, bool *changed) {
+	bool written = false;
+	*changed = false;
+	for (size_t i = 0; i < lengthof(varname); ++i) {
+		struct udiald_var *v = &state->vars[i];
+		if (!v->dirty)
+			continue;
+		v->dirty = false;
+		*changed = true;
+		if (udiald_var_shm_only(i))
+			continue;
+		udiald_config_revert(state, varname[i]);
+		if (v->set)
+			udiald_config_set(state, varname[i], v->value);
+		written = true;
+	}
+	return written;
+}
+
+/**
+ * Write all changed values and save the uci state, including any
+ * changes made to it directly.
+ */
+void udiald_var_commit(struct udiald_state *state) {
+	bool changed;
+	uloop_timeout_cancel(&flush_timer);
+	udiald_var_write(state, &changed);
+	ucix_save(state->uci, state->uciname);
+	last_flush = udiald_util_monotonic_ms();
+	if (changed)
+		udiald_ubus_notify(state);
+}
+
+static void udiald_var_flush_timer(struct uloop_timeout *t) {
+	bool changed;
+	if (udiald_var_write(flush_state, &changed))
+		ucix_save(flush_state->uci, flush_state->uciname);
+	if (changed) {
+		last_flush = udiald_util_monotonic_ms();
+		udiald_ubus_notify(flush_state);
+	}
+}
+
+/**
+ * Write and save changed values from the uloop event loop, soon but
+ * not more often than once every UDIALD_VAR_FLUSH_INTERVAL. Call
+ * udiald_var_commit before leaving the event loop.
+ */
+void udiald_var_flush_soon(struct udiald_state *state) {
+	bool dirty = false;
+	for (size_t i = 0; i < lengthof(varname); ++i)
+		dirty = dirty || state->vars[i].dirty;
+	if (!dirty || flush_timer.pending)
+		return;
+
+	flush_state = state;
+	uint64_t now = udiald_util_monotonic_ms();
+	uint64_t next = last_flush + UDIALD_VAR_FLUSH_INTERVAL;
+	uloop_timeout_set(&flush_timer, next > now ? (int)(next - now) : 0);
+}
@@ -0,0 +1,283 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Benchmark for the tty reading code in tty.c.
+ *
+ * A fake modem is run on the master side of a pseudo terminal, which
+ * answers every command with a canned reply. The slave side is read
+ * using udiald_tty_get and, for comparison, using the old one byte per
+ * read() implementation. For both, the number of syscalls and the cpu
+ * time used per response is reported.
+ *
+ * Syscalls are counted by linking with --wrap=read,--wrap=write,--wrap=poll
+ * (see the bench target in the Makefile).
+ *
+ * Run as:
+ *   make bench
+ * or:
+ *   tools/bench-tty [-n iterations]
+ */
+
+#define _GNU_SOURCE // Get posix_openpt and friends
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "udiald.h"
+
+int verbose = 0;
+
+static unsigned long nread, nwrite, npoll;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+	nread++;
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+	nwrite++;
+	return __real_write(fd, buf, count);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	npoll++;
+	return __real_poll(fds, nfds, timeout);
+}
+
+struct bench_reply {
+	const char *name;
+	const char *cmd;
+	const char *reply;
+};
+
+static const struct bench_reply replies[] = {
+	{
+		.name = "short",
+		.cmd = "AT+CSQ\r",
+		.reply = "\r\n+CSQ: 14,99\r\n\r\nOK\r\n",
+	},
+	{
+		.name = "ATI",
+		.cmd = "ATI\r",
+		.reply = "\r\nManufacturer: huawei\r\n"
+			"Model: E1752\r\n"
+			"Revision: 11.126.03.00.00\r\n"
+			"IMEI: 350000000000000\r\n"
+			"+GCAP: +CGSM,+DS,+ES\r\n"
+			"\r\nOK\r\n",
+	},
+	{
+		.name = "AT+COPS=?",
+		.cmd = "AT+COPS=?\r",
+		.reply = "\r\n+COPS: (2,\"T-Mobile NL\",\"TMO NL\",\"20416\",2),"
+			"(1,\"vodafone NL\",\"voda NL\",\"20404\",2),"
+			"(1,\"NL KPN\",\"KPN\",\"20408\",2),"
+			"(1,\"T-Mobile NL\",\"TMO NL\",\"20416\",0),"
+			"(1,\"vodafone NL\",\"voda NL\",\"20404\",0),"
+			"(1,\"NL KPN\",\"KPN\",\"20408\",0),"
+			",(0,1,2,3,4),(0,1,2)\r\n"
+			"\r\nOK\r\n",
+	},
+};
+
+/*
+ * Run the fake modem on the master side of the pty. Every time a
+ * carriage return is received, the reply for the command that was
+ * received is written back in one go. Never returns.
+ */
+static void bench_modem(int master) {
+	char cmd[64];
+	size_t len = 0;
+
+	while (1) {
+		ssize_t n = __real_read(master, cmd + len, sizeof(cmd) - len - 1);
+		if (n <= 0)
+			_exit(0);
+		len += n;
+		cmd[len] = '\0';
+
+		char *end = strchr(cmd, '\r');
+		if (!end) {
+			if (len == sizeof(cmd) - 1)
+				len = 0;
+			continue;
+		}
+
+		for (size_t i = 0; i < lengthof(replies); ++i) {
+			if (!strncmp(cmd, replies[i].cmd, end - cmd + 1)) {
+				__real_write(master, replies[i].reply, strlen(replies[i].reply));
+				break;
+			}
+		}
+		len = 0;
+	}
+}
+
+static const char *legacy_resstr[] = {
+	[UDIALD_AT_OK] = "OK",
+	[UDIALD_AT_CONNECT] = "CONNECT",
+	[UDIALD_AT_ERROR] = "ERROR",
+	[UDIALD_AT_CMEERROR] = "+CME ERROR",
+	[UDIALD_AT_NODIALTONE] = "NO DIALTONE",
+	[UDIALD_AT_BUSY] = "BUSY",
+	[UDIALD_AT_NOCARRIER] = "NO CARRIER",
+	[UDIALD_AT_NOT_SUPPORTED] = "COMMAND NOT SUPPORT",
+};
+
+/*
+ * The previous implementation of udiald_tty_get, which does a single
+ * read() call for every byte received. Kept here for comparison only.
+ */
+static enum udiald_atres legacy_tty_get(int fd, struct udiald_tty_read *r, int timeout) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLERR | POLLHUP};
+	char raw_buf[512];
+	char *c = raw_buf;
+	char *start = c;
+	size_t rem = sizeof(raw_buf);
+	bool in_newline = true;
+	r->lines = 0;
+
+	while (rem > 0) {
+		if (poll(&pfd, 1, timeout) <= 0)
+			return UDIALD_FAIL;
+
+		ssize_t rxed;
+		while ((rxed = read(fd, c, 1)) > 0) {
+			if (c[0] == '\r' || c[0] == '\n') {
+				if (!in_newline) {
+					in_newline = true;
+					c[0] = '\0';
+					++r->lines;
+					for (size_t i = 0; i < lengthof(legacy_resstr); ++i)
+						if (!strncmp(start, legacy_resstr[i], strlen(legacy_resstr[i])))
+							return i;
+				} else {
+					rxed = 0;
+				}
+			} else if (in_newline) {
+				start = c;
+				in_newline = false;
+			}
+			rem -= rxed;
+			c += rxed;
+		}
+	}
+	return UDIALD_FAIL;
+}
+
+static double cpu_usec(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_run(int fd, const struct bench_reply *reply, bool legacy, int iterations) {
+	struct udiald_tty_read r;
+
+	nread = nwrite = npoll = 0;
+	double cpu = cpu_usec();
+
+	for (int i = 0; i < iterations; ++i) {
+		udiald_tty_put(fd, reply->cmd);
+		enum udiald_atres res;
+		if (legacy)
+			res = legacy_tty_get(fd, &r, 2500);
+		else
+			res = udiald_tty_get(fd, &r, NULL, 2500);
+
+		if (res != UDIALD_AT_OK) {
+			fprintf(stderr, "%s: unexpected result %d\n", reply->name, res);
+			exit(1);
+		}
+	}
+
+	cpu = cpu_usec() - cpu;
+	printf("%-12s %-9s %9.1f %7.1f %7.1f %7.1f %10.1f\n",
+		reply->name, legacy ? "legacy" : "buffered",
+		(double)(nread + nwrite + npoll) / iterations,
+		(double)nread / iterations,
+		(double)npoll / iterations,
+		(double)nwrite / iterations,
+		cpu / iterations);
+}
+
+int main(int argc, char *const argv[]) {
+	int iterations = 2000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	// Don't let syslog calls influence the results
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("Failed to allocate pty");
+		return 1;
+	}
+
+	pid_t modem = fork();
+	if (modem == -1) {
+		perror("Failed to fork");
+		return 1;
+	} else if (modem == 0) {
+		bench_modem(master);
+	}
+
+	int fd = udiald_tty_open(ptsname(master));
+	if (fd < 0) {
+		perror("Failed to open pty");
+		return 1;
+	}
+
+	printf("%d iterations per reply\n", iterations);
+	printf("%-12s %-9s %9s %7s %7s %7s %10s\n",
+		"reply", "reader", "syscalls", "read", "poll", "write", "cpu (us)");
+	for (size_t i = 0; i < lengthof(replies); ++i) {
+		bench_run(fd, &replies[i], true, iterations);
+		bench_run(fd, &replies[i], false, iterations);
+	}
+
+	kill(modem, SIGTERM);
+	waitpid(modem, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,253 @@
+#
+#   udiald - UMTS connection manager
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+#
+
+"""
+Shared code for running udiald against fake modems on pseudo
+terminals, used by udiald-replay.py and udiald-bench.py.
+
+A fake system is created below a temporary directory: sysfs entries
+for the modem, /dev nodes pointing to the pseudo terminals, a uci config
+and a stub pppd. udiald is then run with --sysroot pointing there.
+"""
+
+import heapq
+import os
+import re
+import selectors
+import shutil
+import signal
+import subprocess
+import tempfile
+import time
+import tty
+
+
+class FakeModem:
+    """
+    A modem on the master side of a pseudo terminal. Subclasses
+    implement reply(), which returns the (delay in seconds, bytes)
+    pairs to send in response to a command line.
+    """
+
+    def __init__(self, name, log):
+        self.name = name
+        self.log = log
+        self.master, self.slave = os.openpty()
+        tty.setraw(self.slave)
+        self.path = os.ttyname(self.slave)
+        self.buf = b''
+        # (time, command) for every command received
+        self.commands = []
+        # Time of every write to udiald
+        self.writes = []
+        # Sum of the delay before the last reply of every command
+        self.modem_time = 0
+
+    def reply(self, cmd):
+        raise NotImplementedError
+
+    def start(self, now, queue):
+        """Called when udiald is started, e.g. to schedule URCs."""
+
+    def received(self, data, now, queue):
+        """Handle bytes written by udiald, scheduling replies on queue."""
+        self.buf += data
+        while b'\r' in self.buf:
+            cmd, self.buf = self.buf.split(b'\r', 1)
+            cmd = cmd.strip()
+            if not cmd:
+                continue
+            self.log('%.1f ms %s: %s' % (now * 1000, self.name, cmd.decode('latin-1')))
+            self.commands.append((now, cmd))
+            replies = self.reply(cmd)
+            if replies:
+                self.modem_time += replies[-1][0]
+            for delay, reply in replies:
+                queue.push(now + delay, self, reply)
+
+    def close(self):
+        os.close(self.master)
+        os.close(self.slave)
+
+
+class SendQueue:
+    """Replies waiting to be written, ordered by time."""
+
+    def __init__(self):
+        self.heap = []
+        self.seq = 0
+
+    def push(self, when, modem, data):
+        heapq.heappush(self.heap, (when, self.seq, modem, data))
+        self.seq += 1
+
+    def timeout(self, now):
+        if not self.heap:
+            return None
+        return max(0, self.heap[0][0] - now)
+
+    def pop_due(self, now):
+        while self.heap and self.heap[0][0] <= now:
+            yield heapq.heappop(self.heap)[2:]
+
+
+# ^NDISSTAT URC or ^NDISSTATQRY reply saying the NCM connection is up
+NDIS_UP = re.compile(rb'\^NDISSTAT(QRY)?: *1[,\r]')
+
+
+PPPD_STUB = '''#!/bin/sh
+# Stub pppd: run the connect script on the device and stay up until
+# terminated, like "pppd nodetach" would. Like pppd, give the script
+# the device opened read-write on both stdin and stdout. Without a
+# connect script (udiald_inprocess_dial), udiald dialed already.
+# The options file is a pipe, so read it only once.
+opts=$(cat "$2")
+dev=$(printf '%s\\n' "$opts" | sed -n '1{/^\//p}')
+connect=$(printf '%s\\n' "$opts" | sed -n 's/^connect "\\(.*\\)"$/\\1/p')
+if [ -n "$connect" ]; then
+    sh -c "$connect" <> "$dev" >&0 || exit 8
+fi
+trap 'exit 5' TERM INT
+while true; do sleep 1; done
+'''
+
+
+def make_sysroot(root, args, ttys):
+    """
+    Create the fake sysfs, /dev, uci config and pppd below root. ttys
+    maps tty indices to the device node to use for them.
+    """
+    dev_id = '1-1'
+    usb = os.path.join(root, 'sys/bus/usb/devices', dev_id)
+    os.makedirs(usb)
+    with open(os.path.join(usb, 'idVendor'), 'w') as f:
+        f.write(args.vendor + '\n')
+    with open(os.path.join(usb, 'idProduct'), 'w') as f:
+        f.write(args.product + '\n')
+
+    os.makedirs(os.path.join(root, 'dev'))
+    for i in range(args.ttys):
+        iface = os.path.join(usb, '%s:1.%d' % (dev_id, i))
+        os.makedirs(os.path.join(iface, 'ttyUSB%d' % i))
+        os.symlink('../../../../bus/usb/drivers/' + args.driver, os.path.join(iface, 'driver'))
+        os.symlink(ttys.get(i, '/dev/null'), os.path.join(root, 'dev/ttyUSB%d' % i))
+
+    if args.netdev:
+        # NCM interface, on the USB interface after the ttys. udiald
+        # brings it up, so it has to exist (e.g. a dummy interface).
+        iface = os.path.join(usb, '%s:1.%d' % (dev_id, args.ttys))
+        os.makedirs(os.path.join(iface, 'net', args.netdev))
+        os.symlink('../../../../bus/usb/drivers/huawei_cdc_ncm', os.path.join(iface, 'driver'))
+
+    os.makedirs(os.path.join(root, 'etc/config'))
+    os.makedirs(os.path.join(root, 'var/state'))
+    with open(os.path.join(root, 'etc/config/network'), 'w') as f:
+        f.write("config interface '%s'\n" % args.network)
+        for opt in args.set:
+            key, _, value = opt.partition('=')
+            f.write("\toption %s '%s'\n" % (key, value))
+
+    os.makedirs(os.path.join(root, 'usr/sbin'))
+    pppd = os.path.join(root, 'usr/sbin/pppd')
+    with open(pppd, 'w') as f:
+        f.write(PPPD_STUB)
+    os.chmod(pppd, 0o755)
+
+
+def add_arguments(parser):
+    """Add the options used by run() to an ArgumentParser."""
+    parser.add_argument('--udiald', default='./udiald', help='udiald binary to run')
+    parser.add_argument('--repeat', type=int, default=1, help='number of runs')
+    parser.add_argument('--timeout', type=float, default=120, help='give up after this many seconds')
+    parser.add_argument('--vendor', default='12d1', help='USB vendor id of the fake modem')
+    parser.add_argument('--product', default='1003', help='USB product id of the fake modem')
+    parser.add_argument('--driver', default='option', help='driver of the fake modem')
+    parser.add_argument('--ttys', type=int, default=3, help='number of ttys of the fake modem')
+    parser.add_argument('--ctl', type=int, default=1, help='index of the control tty')
+    parser.add_argument('--dat', type=int, default=0, help='index of the data tty')
+    parser.add_argument('--netdev', help='add an NCM network interface with this name to the fake modem')
+    parser.add_argument('--network', default='wan', help='uci network section to use')
+    parser.add_argument('--set', action='append', default=['udiald_apn=internet'],
+                        metavar='OPTION=VALUE', help='set an option in the uci network section')
+    parser.add_argument('-v', '--verbose', action='store_true', help='log every command')
+    parser.add_argument('udiald_args', nargs='*', help='extra arguments for udiald (after --)')
+
+
+def run(args, ctl, dat):
+    """
+    Run udiald against the given control and data tty modems, until
+    the data tty modem sends CONNECT or, on the NCM data path, the
+    control tty modem reports the connection as up (or udiald exits, or
+    the timeout passes).
+
+    Returns the time of the CONNECT relative to the start of udiald
+    (or None), and all times in the modems are made relative to the
+    start as well.
+    """
+    modems = {ctl.master: ctl, dat.master: dat}
+    root = tempfile.mkdtemp(prefix='udiald-sim-')
+    try:
+        make_sysroot(root, args, {args.ctl: ctl.path, args.dat: dat.path})
+        cmd = [args.udiald, '--sysroot', root, '-n', args.network] + args.udiald_args
+        ctl.log('Running %s' % ' '.join(cmd))
+
+        queue = SendQueue()
+        sel = selectors.DefaultSelector()
+        for fd in modems:
+            sel.register(fd, selectors.EVENT_READ)
+
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd)
+        for m in modems.values():
+            m.start(0, queue)
+
+        connected = None
+        while connected is None and proc.poll() is None:
+            now = time.monotonic() - start
+            if now > args.timeout:
+                break
+            timeout = queue.timeout(now)
+            timeout = 0.1 if timeout is None else min(timeout, 0.1)
+            for key, _ in sel.select(timeout):
+                try:
+                    data = os.read(key.fd, 4096)
+                except OSError:
+                    continue
+                modems[key.fd].received(data, time.monotonic() - start, queue)
+
+            now = time.monotonic() - start
+            for modem, data in queue.pop_due(now):
+                os.write(modem.master, data)
+                modem.writes.append(now)
+                if modem is dat and b'CONNECT' in data:
+                    connected = now
+                if modem is ctl and NDIS_UP.search(data):
+                    connected = now
+
+        if proc.poll() is None:
+            proc.send_signal(signal.SIGTERM)
+            try:
+                proc.wait(5)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+                proc.wait()
+        # Get rid of the stub pppd, in case udiald did not
+        subprocess.run(['pkill', '-f', root], check=False)
+        return connected
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+#   udiald - UMTS connection manager
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+#
+
+"""
+End-to-end connect latency benchmark.
+
+Runs the real udiald against a simulated modem (see modemsim.py for the
+fake sysfs, /dev and pppd) and reports the time until the dialer gets
+CONNECT, split into phases:
+
+  startup     udiald start until the first command on the control tty
+  setup       modem setup on the control tty (reset, identify, SIM,
+              mode), until the last reply before the dialer starts
+  pppd        starting pppd and the dialer, until the first command on
+              the data tty
+  predial     dialer commands before the dial command
+  dial        dial command until CONNECT
+
+On the NCM data path (see tools/sim/huawei-e3372-ncm.sim), there is no
+pppd or dialer: setup ends at AT^NDISDUP, and dial lasts until the modem
+reports the connection as up.
+
+The simulated modem is described by a script file, see
+tools/sim/huawei-e1752.sim for the format.
+
+Example:
+    tools/udiald-bench.py --udiald ./udiald --repeat 5 tools/sim/huawei-e1752.sim
+"""
+
+import argparse
+import fnmatch
+import random
+import statistics
+import sys
+
+import modemsim
+
+# Final result codes, a reply ending in one of these gets no extra OK
+FINAL = ('OK', 'CONNECT', 'ERROR', '+CME ERROR', '+CMS ERROR', 'NO CARRIER',
+         'NO DIALTONE', 'BUSY', 'NO ANSWER', 'COMMAND NOT SUPPORT')
+
+PHASES = ('startup', 'setup', 'pppd', 'predial', 'dial')
+
+
+class SimScript:
+    """
+    A parsed simulator script. Each line is one of:
+
+      cmd <pattern> <latency ms> [<line> [| <line>...]]
+          Reply to commands matching the (fnmatch) pattern with the
+          given lines, after the given latency. OK is added unless
+          the last line is a final result code.
+      default <latency ms> [<line> [| <line>...]]
+          Reply for commands that match no pattern (default: OK).
+      fail <pattern> <probability> <line>|timeout
+          Reply with the given line instead (or not at all) with the
+          given probability, for failure injection.
+      urc <at ms> [every <ms>] <line>
+          Send an unsolicited line on the control tty at the given
+          time after startup, optionally repeating.
+      maxcmdlen <n>
+          Reply ERROR to command lines longer than n characters.
+
+    Patterns match single commands, without the "AT" prefix, so
+    "AT+CGMI;+CGMM" is matched as "+CGMI" and "+CGMM".
+    """
+
+    def __init__(self, path):
+        self.cmds = []
+        self.fails = []
+        self.urcs = []
+        self.default = (0.01, ['OK'])
+        self.maxcmdlen = None
+        with open(path) as f:
+            for lineno, line in enumerate(f, 1):
+                line = line.strip()
+                if not line or line.startswith('#'):
+                    continue
+                try:
+                    self.parse(line)
+                except (ValueError, IndexError):
+                    raise SystemExit('%s:%d: invalid line: %s' % (path, lineno, line))
+
+    @staticmethod
+    def reply_lines(rest):
+        lines = [l.strip() for l in rest.split('|')] if rest.strip() else []
+        if not lines or not lines[-1].startswith(FINAL):
+            lines.append('OK')
+        return lines
+
+    def parse(self, line):
+        kind, _, rest = line.partition(' ')
+        if kind == 'cmd':
+            pattern, latency, rest = (rest.split(None, 2) + [''])[:3]
+            self.cmds.append((pattern, float(latency) / 1000, self.reply_lines(rest)))
+        elif kind == 'default':
+            latency, rest = (rest.split(None, 1) + [''])[:2]
+            self.default = (float(latency) / 1000, self.reply_lines(rest))
+        elif kind == 'fail':
+            pattern, prob, rest = rest.split(None, 2)
+            self.fails.append((pattern, float(prob), rest))
+        elif kind == 'urc':
+            words = rest.split(None, 3)
+            if words[1] == 'every':
+                self.urcs.append((float(words[0]) / 1000, float(words[2]) / 1000, words[3]))
+            else:
+                self.urcs.append((float(words[0]) / 1000, None, rest.split(None, 1)[1]))
+        elif kind == 'maxcmdlen':
+            self.maxcmdlen = int(rest)
+        else:
+            raise ValueError(kind)
+
+
+class SimModem(modemsim.FakeModem):
+    """A modem that replies according to a SimScript."""
+
+    def __init__(self, name, script, rng, log, urcs):
+        super().__init__(name, log)
+        self.script = script
+        self.rng = rng
+        self.urcs = urcs
+
+    def start(self, now, queue):
+        if not self.urcs:
+            return
+        for at, every, line in self.script.urcs:
+            data = ('\r\n%s\r\n' % line).encode()
+            # Schedule repeating URCs for the maximum run time
+            t = at
+            while t < 600:
+                queue.push(now + t, self, data)
+                if not every:
+                    break
+                t += every
+
+    def reply_one(self, cmd):
+        """Return the latency and reply lines for a single command."""
+        for pattern, prob, line in self.script.fails:
+            if fnmatch.fnmatchcase(cmd, pattern) and self.rng.random() < prob:
+                self.log('%s: injecting failure for %s' % (self.name, cmd))
+                return 0, (None if line == 'timeout' else [line])
+        for pattern, latency, lines in self.script.cmds:
+            if fnmatch.fnmatchcase(cmd, pattern):
+                return latency, lines
+        return self.script.default
+
+    def reply(self, cmd):
+        line = cmd.decode('latin-1')
+        if not line.upper().startswith('AT'):
+            return []
+        if self.script.maxcmdlen and len(line) + 1 > self.script.maxcmdlen:
+            return [(0, b'\r\nERROR\r\n')]
+
+        # Handle a command line with several commands like a real
+        # modem: execute them in order, stop at the first error and
+        # send a single final result code.
+        total = 0
+        out = []
+        for sub in line[2:].split(';'):
+            latency, lines = self.reply_one(sub)
+            total += latency
+            if lines is None:
+                return []
+            out += lines[:-1]
+            final = lines[-1]
+            if final != 'OK':
+                break
+        out.append(final)
+        data = ''.join('\r\n%s\r\n' % l for l in out).encode()
+        return [(total, data)]
+
+
+def phases(ctl, dat, connected):
+    """Split the time until CONNECT into the PHASES."""
+    if not ctl.commands:
+        return None
+    first_ctl = ctl.commands[0][0]
+    ndis = [t for t, cmd in ctl.commands if cmd.upper().startswith(b'AT^NDISDUP=1,1')]
+    if ndis:
+        # NCM: the control tty connects, no pppd or dialer
+        first_dat = dial_start = ndis[0]
+    elif dat.commands:
+        first_dat = dat.commands[0][0]
+        dial = [t for t, cmd in dat.commands if cmd.upper().startswith(b'ATD')]
+        dial_start = dial[0] if dial else connected
+    else:
+        return None
+    setup_end = max([t for t in ctl.writes if t < first_dat] or [first_ctl])
+    points = (0, first_ctl, setup_end, first_dat, dial_start, connected)
+    return [b - a for a, b in zip(points, points[1:])]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark udiald connect latency against a simulated modem.')
+    parser.add_argument('script', help='simulator script')
+    parser.add_argument('--seed', type=int, default=0, help='random seed for failure injection')
+    modemsim.add_arguments(parser)
+    parser.set_defaults(product='1001', ctl=2)
+    args = parser.parse_args()
+
+    def log(msg):
+        if args.verbose:
+            print(msg, file=sys.stderr)
+
+    script = SimScript(args.script)
+    rng = random.Random(args.seed)
+    results = []
+    print('%-4s %10s' % ('run', 'total') + ''.join('%10s' % p for p in PHASES) + '  (ms)')
+    for i in range(args.repeat):
+        ctl = SimModem('ctl', script, rng, log, True)
+        dat = SimModem('dat', script, rng, log, False)
+        try:
+            connected = modemsim.run(args, ctl, dat)
+        finally:
+            ctl.close()
+            dat.close()
+
+        split = phases(ctl, dat, connected) if connected is not None else None
+        if split is None:
+            print('%-4d no connection' % (i + 1))
+            return 1
+        results.append([connected] + split)
+        print('%-4d %10.1f' % (i + 1, connected * 1000) + ''.join('%10.1f' % (t * 1000) for t in split))
+
+    if len(results) > 1:
+        medians = [statistics.median(col) for col in zip(*results)]
+        print('%-4s %10.1f' % ('med', medians[0] * 1000) + ''.join('%10.1f' % (t * 1000) for t in medians[1:]))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+#   udiald - UMTS connection manager
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+#
+
+"""
+Convert a binary signal history dump, as written by udiald (see
+udiald_history_dump in src/history.c), to json or csv.
+
+The json output has the same format as the history ubus method. The
+csv output has a line per sample, with the interval of its ring as the
+first column.
+
+Example:
+    kill -USR1 $(pidof udiald)
+    tools/udiald-history.py /tmp/udiald-wan.history
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b'UDHS'
+VERSION = 1
+# Fields of struct udiald_history_sample
+SAMPLE = struct.Struct('=IBBBBBBBB')
+FIELDS = ['time', 'rssi', 'rssi_min', 'rssi_max', 'ber', 'rat', 'registration', 'provider', 'connected']
+NAME_FIELDS = ('rat', 'registration', 'provider')
+NAMELEN = 32
+
+
+def read_history(data):
+    """Parse a dump, return it in the format of the history ubus method."""
+    if data[:4] != MAGIC:
+        raise ValueError('not a udiald history dump')
+    version, size, nnames, nrings = struct.unpack_from('=IIII', data, 4)
+    if version != VERSION or size != SAMPLE.size:
+        raise ValueError('unsupported version %d (sample size %d)' % (version, size))
+    off = 20
+
+    names = []
+    for i in range(nnames):
+        names.append(data[off:off + NAMELEN].split(b'\0', 1)[0].decode('utf-8', 'replace'))
+        off += NAMELEN
+
+    def name(i):
+        if i == 0xff:
+            return ''
+        if i == 0xfe:
+            return 'other'
+        return names[i]
+
+    history = []
+    for r in range(nrings):
+        interval, count = struct.unpack_from('=II', data, off)
+        off += 8
+        samples = []
+        for i in range(count):
+            s = list(SAMPLE.unpack_from(data, off))
+            off += SAMPLE.size
+            for f in NAME_FIELDS:
+                j = FIELDS.index(f)
+                s[j] = name(s[j])
+            samples.append(s)
+        history.append({'interval': interval, 'samples': samples})
+    return {'fields': FIELDS, 'history': history}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert a udiald signal history dump.')
+    parser.add_argument('dump', help='binary history dump')
+    parser.add_argument('--csv', action='store_true', help='output csv instead of json')
+    args = parser.parse_args()
+
+    with open(args.dump, 'rb') as f:
+        history = read_history(f.read())
+
+    if args.csv:
+        print(','.join(['interval'] + history['fields']))
+        for ring in history['history']:
+            for s in ring['samples']:
+                print(','.join(str(v) for v in [ring['interval']] + s))
+    else:
+        json.dump(history, sys.stdout, separators=(',', ':'))
+        print()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+#
+#   udiald - UMTS connection manager
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+#
+
+"""
+Replay a recorded modem session against the real udiald.
+
+The input is a wire trace as written by udiald (see "Debugging" in the
+README), e.g. after sending SIGUSR1 to a connected udiald. Every command
+udiald sent in the trace is turned into an exchange: the command line
+and the bytes the modem sent after it, with their original delays.
+
+A fake sysfs tree, device nodes (pseudo terminals), uci config and a
+stub pppd are created below a temporary directory (see modemsim.py),
+which is passed to udiald using --sysroot. udiald then runs its normal
+connect path against the pseudo terminals. Whenever it sends a command, the
+recorded reply is played back with the recorded timing, optionally
+scaled. Commands on the data tty (used by the dialer that pppd starts)
+come from a second trace, or get a plain OK (CONNECT for dial commands).
+
+Once the fake modem sends CONNECT on the data tty, the connect time is
+reported and udiald is terminated.
+
+Example:
+    tools/udiald-replay.py --udiald ./udiald --vendor 12d1 --product 1003 \\
+        /tmp/udiald-wan.trace
+"""
+
+import argparse
+import collections
+import re
+import statistics
+import sys
+
+import modemsim
+
+TRACE_LINE = re.compile(r'^(\d+)\.(\d{9}) (-?\d+) ([<>]) (.*)$')
+
+
+def unescape(data):
+    """Undo the escaping done by udiald_trace_dump."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        c = data[i]
+        if c == '\\' and i + 1 < len(data):
+            n = data[i + 1]
+            if n == 'r':
+                out += b'\r'
+                i += 2
+                continue
+            if n == 'n':
+                out += b'\n'
+                i += 2
+                continue
+            if n == 'x' and i + 3 < len(data):
+                out.append(int(data[i + 2:i + 4], 16))
+                i += 4
+                continue
+        out += c.encode('latin-1')
+        i += 1
+    return bytes(out)
+
+
+def read_trace(path, fd=None):
+    """
+    Read a trace file and return a list of (seconds, direction, bytes)
+    tuples for the given fd (or the fd with the most entries).
+    """
+    entries = []
+    with open(path) as f:
+        for line in f:
+            m = TRACE_LINE.match(line.rstrip('\n'))
+            if not m:
+                continue
+            ts = int(m.group(1)) + int(m.group(2)) / 1e9
+            entries.append((ts, int(m.group(3)), m.group(4), unescape(m.group(5))))
+
+    if fd is None and entries:
+        fd = collections.Counter(e[1] for e in entries).most_common(1)[0][0]
+    return [(ts, d, data) for ts, efd, d, data in entries if efd == fd]
+
+
+class Exchange:
+    """A command and the bytes that followed it, with their delays."""
+
+    def __init__(self, cmd):
+        self.cmd = cmd
+        # (delay in seconds after the command, bytes)
+        self.replies = []
+
+
+def build_script(entries):
+    """
+    Turn trace entries into exchanges, keyed by command line. Bytes
+    received before the first complete command are stale and are
+    skipped.
+    """
+    script = collections.defaultdict(collections.deque)
+    pending = b''
+    current = None
+    sent_at = 0
+    for ts, direction, data in entries:
+        if direction == '>':
+            pending += data
+            while b'\r' in pending:
+                cmd, pending = pending.split(b'\r', 1)
+                current = Exchange(cmd.strip())
+                sent_at = ts
+                script[current.cmd].append(current)
+        elif current:
+            current.replies.append((ts - sent_at, data))
+    return script
+
+
+def default_reply(cmd):
+    """Reply for commands that are not in the script."""
+    if cmd.upper().startswith(b'ATD'):
+        return b'\r\nCONNECT\r\n'
+    return b'\r\nOK\r\n'
+
+
+class ReplayModem(modemsim.FakeModem):
+    """Play back a script built from a trace."""
+
+    def __init__(self, name, script, scale, log, fallback):
+        super().__init__(name, log)
+        self.script = script
+        self.scale = scale
+        self.fallback = fallback
+        self.unmatched = []
+
+    def reply(self, cmd):
+        exchanges = self.script.get(cmd)
+        if exchanges:
+            ex = exchanges.popleft()
+            return [(delay * self.scale, data) for delay, data in ex.replies]
+        if self.fallback:
+            return [(0, default_reply(cmd))]
+        self.unmatched.append(cmd)
+        return [(0, b'\r\nERROR\r\n')]
+
+
+def run_once(args, log):
+    ctl_script = build_script(read_trace(args.trace, args.fd))
+    dat_script = build_script(read_trace(args.dialer_trace)) if args.dialer_trace else {}
+
+    ctl = ReplayModem('ctl', ctl_script, args.scale, log, args.lenient)
+    dat = ReplayModem('dat', dat_script, args.scale, log, True)
+    try:
+        connected = modemsim.run(args, ctl, dat)
+    finally:
+        ctl.close()
+        dat.close()
+
+    for name in ctl.unmatched:
+        print('warning: command not in trace: %s' % name.decode('latin-1'), file=sys.stderr)
+    return connected, ctl.modem_time + dat.modem_time
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay a recorded modem session against udiald.')
+    parser.add_argument('trace', help='wire trace of the control tty')
+    parser.add_argument('--dialer-trace', help='wire trace of the dialer (data tty)')
+    parser.add_argument('--fd', type=int, help='fd to take from the trace (default: most used)')
+    parser.add_argument('--scale', type=float, default=1.0, help='multiply all modem delays by this factor')
+    parser.add_argument('--lenient', action='store_true',
+                        help='reply OK to control commands not in the trace, instead of ERROR')
+    modemsim.add_arguments(parser)
+    args = parser.parse_args()
+
+    def log(msg):
+        if args.verbose:
+            print(msg, file=sys.stderr)
+
+    results = []
+    for i in range(args.repeat):
+        connected, modem_time = run_once(args, log)
+        if connected is None:
+            print('run %d: no connection' % (i + 1))
+            return 1
+        results.append(connected)
+        print('run %d: connected after %.1f ms (modem delays %.1f ms, udiald %.1f ms)' % (
+            i + 1, connected * 1000, modem_time * 1000, (connected - modem_time) * 1000))
+
+    if len(results) > 1:
+        print('min %.1f ms, median %.1f ms, max %.1f ms' % (
+            min(results) * 1000, statistics.median(results) * 1000, max(results) * 1000))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
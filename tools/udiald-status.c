@@ -0,0 +1,177 @@
+/**
+ *   udiald - UMTS connection manager
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Print the status udiald publishes in its status file (see src/shm.h),
+ * one key=value per line. With field names as arguments, only the
+ * values of those fields are printed, one per line:
+ *
+ *   tools/udiald-status [-n network] [-f file] [field...]
+ *
+ * The exit code is 0 when udiald is running, 1 when it is not (the
+ * last status is still printed) and 2 when the file cannot be read.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+
+#define lengthof(x) (sizeof(x) / sizeof(*x))
+
+static struct udiald_shm_status st;
+static char numbuf[23][24];
+
+static const char *intstr(int i, int64_t val) {
+	snprintf(numbuf[i], sizeof(numbuf[i]), "%" PRId64, val);
+	return numbuf[i];
+}
+
+// Format a value in tenths as a decimal, or empty when it is unknown
+static const char *tenthstr(int i, int32_t val) {
+	if (val == UDIALD_SHM_UNKNOWN)
+		numbuf[i][0] = '\0';
+	else if (val % 10)
+		snprintf(numbuf[i], sizeof(numbuf[i]), "%s%d.%d", val < 0 ? "-" : "", abs(val) / 10, abs(val) % 10);
+	else
+		snprintf(numbuf[i], sizeof(numbuf[i]), "%d", val / 10);
+	return numbuf[i];
+}
+
+static void usage(const char *app) {
+	fprintf(stderr, "Usage: %s [-n network] [-f file] [field...]\n", app);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	const char *network = "wan", *file = NULL;
+	char path[256];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+		switch (opt) {
+			case 'n':
+				network = optarg;
+				break;
+			case 'f':
+				file = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (!file) {
+		snprintf(path, sizeof(path), UDIALD_SHM_PATH, network);
+		file = path;
+	}
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) || (size_t)sb.st_size < sizeof(st)) {
+		fprintf(stderr, "%s: Cannot read %s\n", argv[0], file);
+		return 2;
+	}
+	void *p = mmap(NULL, sizeof(st), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: Cannot map %s\n", argv[0], file);
+		return 2;
+	}
+	if (udiald_shm_read(p, &st)) {
+		if (errno == EAGAIN)
+			fprintf(stderr, "%s: %s is stuck in an update, udiald may have died\n", argv[0], file);
+		else
+			fprintf(stderr, "%s: %s is not a udiald status file\n", argv[0], file);
+		return 2;
+	}
+
+	// Make sure the strings are terminated, even if the writer is broken
+	st.state[sizeof(st.state) - 1] = '\0';
+	st.sim_state[sizeof(st.sim_state) - 1] = '\0';
+	st.provider[sizeof(st.provider) - 1] = '\0';
+	st.rat[sizeof(st.rat) - 1] = '\0';
+	st.registration[sizeof(st.registration) - 1] = '\0';
+	st.modem_id[sizeof(st.modem_id) - 1] = '\0';
+	st.modem_name[sizeof(st.modem_name) - 1] = '\0';
+	st.error_msg[sizeof(st.error_msg) - 1] = '\0';
+
+	const struct {
+		const char *name;
+		const char *value;
+	} fields[] = {
+		{"pid", intstr(0, st.pid)},
+		{"state", st.state},
+		{"connected", intstr(1, st.connected)},
+		{"sim_state", st.sim_state},
+		{"provider", st.provider},
+		{"rssi", intstr(2, st.rssi)},
+		{"rat", st.rat},
+		{"registration", st.registration},
+		{"modem_id", st.modem_id},
+		{"modem_name", st.modem_name},
+		{"error_code", intstr(3, st.error_code)},
+		{"error_msg", st.error_msg},
+		{"updated", intstr(4, st.updated)},
+		{"rx_bytes", intstr(5, st.rx_bytes)},
+		{"tx_bytes", intstr(6, st.tx_bytes)},
+		{"rx_packets", intstr(7, st.rx_packets)},
+		{"tx_packets", intstr(8, st.tx_packets)},
+		{"rx_errors", intstr(9, st.rx_errors)},
+		{"tx_errors", intstr(10, st.tx_errors)},
+		{"rx_dropped", intstr(11, st.rx_dropped)},
+		{"tx_dropped", intstr(12, st.tx_dropped)},
+		{"rx_rate", intstr(13, st.rx_rate)},
+		{"tx_rate", intstr(14, st.tx_rate)},
+		{"modem_rx_bytes", intstr(15, st.modem_rx_bytes)},
+		{"modem_tx_bytes", intstr(16, st.modem_tx_bytes)},
+		{"signal_rssi", tenthstr(17, st.signal_rssi)},
+		{"signal_rscp", tenthstr(18, st.signal_rscp)},
+		{"signal_ecio", tenthstr(19, st.signal_ecio)},
+		{"signal_rsrp", tenthstr(20, st.signal_rsrp)},
+		{"signal_rsrq", tenthstr(21, st.signal_rsrq)},
+		{"signal_sinr", tenthstr(22, st.signal_sinr)},
+	};
+
+	if (optind == argc) {
+		for (size_t i = 0; i < lengthof(fields); ++i)
+			printf("%s=%s\n", fields[i].name, fields[i].value);
+	}
+	for (int a = optind; a < argc; ++a) {
+		size_t i;
+		for (i = 0; i < lengthof(fields); ++i) {
+			if (!strcmp(argv[a], fields[i].name))
+				break;
+		}
+		if (i == lengthof(fields)) {
+			fprintf(stderr, "%s: Unknown field %s\n", argv[0], argv[a]);
+			return 2;
+		}
+		printf("%s\n", fields[i].value);
+	}
+
+	return st.pid ? 0 : 1;
+}